@@ -0,0 +1,196 @@
+/* Measures the speed and distribution of the string and pointer hashes used by
+ * the hash table over a corpus of PV names of the shape used by our IOCs.  For
+ * comparison the byte at a time hash originally taken from Python is shown.
+ *
+ * Usage: hash_benchmark [corpus-size [repeats]] */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "error.h"
+#include "hashtable.h"
+
+
+#define NAME_SIZE       64
+
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + 1e-9 * (double) ts.tv_nsec;
+}
+
+
+/* The hash originally used for strings, from Python string_hash. */
+static hash_t python_hash(const void *key)
+{
+    const char *s = key;
+    size_t length = strlen(s);
+    if (length == 0)
+        return 0;
+    else
+    {
+        hash_t hash = (hash_t) *s++ << 7;
+        for (size_t i = 1; i < length; i++)
+            hash = (1000003 * hash) ^ (hash_t) (unsigned int) *s++;
+        return hash ^ length;
+    }
+}
+
+static hash_t string_hash(const void *key)
+{
+    return hash_table_hash_bytes(key, strlen(key));
+}
+
+/* The hash originally used for pointers. */
+static hash_t identity_hash(const void *key)
+{
+    return (hash_t) (uintptr_t) key;
+}
+
+
+/* PV names as saved in the persistence file: record type, then a device name
+ * built from sector, cell and device number, then a field path. */
+static char (*make_corpus(unsigned int count))[NAME_SIZE]
+{
+    static const char *types[] = { "ao", "bo", "mbbo", "longout", "waveform" };
+    static const char *devices[] = { "DI-EBPM", "DI-TMBF", "RF-CAV", "PC-QUAD" };
+    static const char *fields[] = {
+        "CF:ATTEN_S", "CF:GAIN_S", "FT:ENABLE_S", "SA:X:OFFSET_S",
+        "SA:Y:OFFSET_S", "TRIG:DELAY_S", "ADC:DAC:MMS:SCALE_S", "CONFIG:MODE_S",
+    };
+    char (*corpus)[NAME_SIZE] = calloc(count, NAME_SIZE);
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        unsigned int n = i;
+        const char *field = fields[n % ARRAY_SIZE(fields)];
+        n /= (unsigned int) ARRAY_SIZE(fields);
+        const char *device = devices[n % ARRAY_SIZE(devices)];
+        n /= (unsigned int) ARRAY_SIZE(devices);
+        unsigned int cell = n % 24 + 1;
+        n /= 24;
+        snprintf(corpus[i], NAME_SIZE, "%s:SR%02uC-%s-%02u:%s:%u",
+            types[i % ARRAY_SIZE(types)], cell, device, n % 16 + 1, field,
+            n / 16);
+    }
+    return corpus;
+}
+
+
+static void benchmark_speed(
+    const char *test, hash_t (*hash)(const void *),
+    const void *const keys[], unsigned int count, unsigned int repeats)
+{
+    hash_t sum = 0;
+    double start = now();
+    for (unsigned int r = 0; r < repeats; r ++)
+        for (unsigned int i = 0; i < count; i ++)
+            sum += hash(keys[i]);
+    double duration = now() - start;
+    printf("%-16s %6.1f ns/hash %8.2f Mhashes/s (checksum %016" PRIx64 ")\n",
+        test, 1e9 * duration / count / repeats,
+        1e-6 * count * repeats / duration, sum);
+}
+
+
+/* Distributes the hashes into 2^bits buckets taken from the given bit offset
+ * in the hash, as done by the two hash table layouts.  A chi-squared ratio
+ * close to 1 indicates a uniform distribution. */
+static void check_distribution(
+    const char *test, const hash_t hashes[], unsigned int count,
+    unsigned int bits, unsigned int shift)
+{
+    size_t buckets = (size_t) 1 << bits;
+    unsigned int *counts = calloc(buckets, sizeof(unsigned int));
+    for (unsigned int i = 0; i < count; i ++)
+        counts[(hashes[i] >> shift) & (buckets - 1)] += 1;
+
+    double expected = (double) count / (double) buckets;
+    double chi_squared = 0;
+    unsigned int max_count = 0;
+    for (size_t i = 0; i < buckets; i ++)
+    {
+        double delta = counts[i] - expected;
+        chi_squared += delta * delta / expected;
+        max_count = MAX(max_count, counts[i]);
+    }
+    printf("%-16s %2u bits >> %u: chi^2/df %8.2f, max bucket %u (mean %.2f)\n",
+        test, bits, shift, chi_squared / (double) (buckets - 1),
+        max_count, expected);
+    free(counts);
+}
+
+
+static int compare_hash(const void *a, const void *b)
+{
+    hash_t x = *(const hash_t *) a;
+    hash_t y = *(const hash_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static void benchmark_distribution(
+    const char *test, hash_t (*hash)(const void *),
+    const void *const keys[], unsigned int count)
+{
+    hash_t *hashes = calloc(count, sizeof(hash_t));
+    for (unsigned int i = 0; i < count; i ++)
+        hashes[i] = hash(keys[i]);
+
+    /* Table sizes for half full tables of these keys. */
+    unsigned int bits = 1;
+    while ((1U << bits) < 2 * count)
+        bits += 1;
+    check_distribution(test, hashes, count, bits, 0);
+    check_distribution(test, hashes, count, bits, 7);
+    check_distribution(test, hashes, count, 7, 0);
+
+    qsort(hashes, count, sizeof(hash_t), compare_hash);
+    unsigned int collisions = 0;
+    for (unsigned int i = 1; i < count; i ++)
+        if (hashes[i] == hashes[i - 1])
+            collisions += 1;
+    printf("%-16s %u full hash collisions\n", test, collisions);
+    free(hashes);
+}
+
+
+int main(int argc, char **argv)
+{
+    unsigned int count = argc > 1 ? (unsigned int) atoi(argv[1]) : 100000;
+    unsigned int repeats = argc > 2 ? (unsigned int) atoi(argv[2]) : 20;
+
+    char (*corpus)[NAME_SIZE] = make_corpus(count);
+    const void **names = calloc(count, sizeof(void *));
+    const void **pointers = calloc(count, sizeof(void *));
+    size_t total_length = 0;
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        names[i] = corpus[i];
+        total_length += strlen(corpus[i]);
+        /* Allocation addresses, 48 bytes apart as for small records. */
+        pointers[i] = (void *) (uintptr_t) (0x7f0000001000 + 48 * (uint64_t) i);
+    }
+    printf("%u PV names, mean length %.1f, for example %s\n",
+        count, (double) total_length / count, corpus[count / 2]);
+
+    benchmark_speed("python string", python_hash, names, count, repeats);
+    benchmark_speed("string", string_hash, names, count, repeats);
+    benchmark_speed("identity ptr", identity_hash, pointers, count, repeats);
+    benchmark_speed("ptr", hash_table_hash_ptr, pointers, count, repeats);
+
+    benchmark_distribution("python string", python_hash, names, count);
+    benchmark_distribution("string", string_hash, names, count);
+    benchmark_distribution("identity ptr", identity_hash, pointers, count);
+    benchmark_distribution("ptr", hash_table_hash_ptr, pointers, count);
+
+    free(corpus);
+    free(names);
+    free(pointers);
+    return 0;
+}
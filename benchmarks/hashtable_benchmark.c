@@ -0,0 +1,237 @@
+/* Measures lookup throughput of the hash table for string keys shaped like PV
+ * names and for pointer keys, at a range of table sizes, together with the
+ * equivalent typed and concurrent tables from hashtable_typed.h.  Insertion,
+ * walking and delete heavy churn are also measured, and the load factor and
+ * probe length distribution are shown after inserting and after churn.  Build
+ * with HASH_TABLE_SWISS=0 to compare the original table layout.
+ *
+ * Usage: hashtable_benchmark [lookups] */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "error.h"
+#include "hashtable.h"
+#include "hashtable_typed.h"
+
+
+#define KEY_SIZE        40
+
+
+DEFINE_HASH_TABLE(string_table,
+    const char *, const char *, hash_string_key, compare_string_key)
+DEFINE_CONCURRENT_HASH_TABLE(concurrent_table,
+    const char *, const char *, hash_string_key, compare_string_key)
+
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + 1e-9 * (double) ts.tv_nsec;
+}
+
+
+static void report(
+    const char *test, unsigned int count, unsigned int lookups,
+    double duration)
+{
+    printf("%-18s %8u keys %8.1f ns/op %8.2f Mops/s\n", test, count,
+        1e9 * duration / lookups, 1e-6 * lookups / duration);
+}
+
+
+static void report_stats(const char *when, struct hash_table *table)
+{
+    hash_table_validate(table);
+    struct hash_table_stats stats;
+    hash_table_get_stats(table, &stats);
+    printf("  %-16s %8zu slots %8zu deleted load %.2f probe mean %.2f "
+        "max %zu:", when, stats.size, stats.deleted, stats.load_factor,
+        stats.mean_probe, stats.max_probe);
+    for (unsigned int i = 0; i < HASH_TABLE_PROBE_HISTOGRAM; i ++)
+        printf(" %.3f", (double) stats.probe_histogram[i] /
+            (double) stats.entries);
+    printf("\n");
+}
+
+
+/* Keys with a long common prefix, as is typical of PV names. */
+static char (*make_keys(unsigned int count, const char *prefix))[KEY_SIZE]
+{
+    char (*keys)[KEY_SIZE] = calloc(count, KEY_SIZE);
+    for (unsigned int i = 0; i < count; i ++)
+        snprintf(keys[i], KEY_SIZE, "%s-DI-TMBF-%02u:ADC:%u:MEAN",
+            prefix, i % 100, i);
+    return keys;
+}
+
+
+/* Lookups in a pseudo-random order so that the benchmark isn't simply
+ * measuring a sequential walk through the table. */
+static unsigned int *make_order(unsigned int count, unsigned int lookups)
+{
+    unsigned int *order = calloc(lookups, sizeof(unsigned int));
+    uint64_t state = 1;
+    for (unsigned int i = 0; i < lookups; i ++)
+    {
+        state = state * UINT64_C(6364136223846793005) + 1;
+        order[i] = (unsigned int) ((state >> 32) % count);
+    }
+    return order;
+}
+
+
+static void benchmark_strings(unsigned int count, unsigned int lookups)
+{
+    char (*keys)[KEY_SIZE] = make_keys(count, "SR");
+    char (*missing)[KEY_SIZE] = make_keys(count, "BR");
+    unsigned int *order = make_order(count, lookups);
+
+    struct hash_table *table = hash_table_create(false);
+    for (unsigned int i = 0; i < count; i ++)
+        hash_table_insert(table, keys[i], keys[i]);
+
+    double start = now();
+    for (unsigned int i = 0; i < lookups; i ++)
+        ASSERT_OK(hash_table_lookup(table, keys[order[i]]));
+    report("string hit", count, lookups, now() - start);
+
+    start = now();
+    for (unsigned int i = 0; i < lookups; i ++)
+        ASSERT_OK(!hash_table_lookup(table, missing[order[i]]));
+    report("string miss", count, lookups, now() - start);
+
+    struct string_table *typed = string_table_create();
+    for (unsigned int i = 0; i < count; i ++)
+        string_table_insert(typed, keys[i], keys[i]);
+
+    start = now();
+    for (unsigned int i = 0; i < lookups; i ++)
+        ASSERT_OK(string_table_lookup(typed, keys[order[i]]));
+    report("typed string hit", count, lookups, now() - start);
+
+    start = now();
+    for (unsigned int i = 0; i < lookups; i ++)
+        ASSERT_OK(!string_table_lookup(typed, missing[order[i]]));
+    report("typed string miss", count, lookups, now() - start);
+
+    string_table_destroy(typed);
+
+    struct concurrent_table *concurrent = concurrent_table_create();
+    for (unsigned int i = 0; i < count; i ++)
+        concurrent_table_add(concurrent, keys[i], keys[i]);
+
+    start = now();
+    for (unsigned int i = 0; i < lookups; i ++)
+        ASSERT_OK(concurrent_table_lookup(concurrent, keys[order[i]]));
+    report("concurrent hit", count, lookups, now() - start);
+
+    concurrent_table_destroy(concurrent);
+    hash_table_destroy(table);
+    free(keys);
+    free(missing);
+    free(order);
+}
+
+
+/* Insertion, walking, and churn where each step deletes the oldest key and
+ * inserts a new one, so that the table fills with tombstones and is
+ * periodically rebuilt by resize_table. */
+static void benchmark_updates(unsigned int count, unsigned int lookups)
+{
+    /* Twice as many keys as are live at once, used as a ring. */
+    char (*keys)[KEY_SIZE] = make_keys(2 * count, "SR");
+
+    struct hash_table *table = hash_table_create(false);
+    double start = now();
+    for (unsigned int i = 0; i < count; i ++)
+        hash_table_insert(table, keys[i], keys[i]);
+    report("string insert", count, count, now() - start);
+    report_stats("after insert", table);
+
+    /* The same keys inserted into a table sized in advance. */
+    struct hash_table_pair *pairs =
+        calloc(count, sizeof(struct hash_table_pair));
+    for (unsigned int i = 0; i < count; i ++)
+        pairs[i] = (struct hash_table_pair) { keys[i], keys[i] };
+    struct hash_table *bulk = hash_table_create(false);
+    start = now();
+    hash_table_insert_bulk(bulk, count, pairs);
+    report("string bulk insert", count, count, now() - start);
+    ASSERT_OK(hash_table_count(bulk) == count);
+    hash_table_validate(bulk);
+    hash_table_destroy(bulk);
+    free(pairs);
+
+    unsigned int walks = MAX(lookups / count, 1U);
+    size_t walked = 0;
+    start = now();
+    for (unsigned int i = 0; i < walks; i ++)
+    {
+        int ix = 0;
+        const void *key;
+        while (hash_table_walk(table, &ix, &key, NULL))
+            walked += 1;
+    }
+    report("string walk", count, (unsigned int) walked, now() - start);
+    ASSERT_OK(walked == (size_t) walks * count);
+
+    start = now();
+    for (unsigned int i = 0; i < lookups; i ++)
+    {
+        unsigned int old = i % (2 * count);
+        unsigned int new = (i + count) % (2 * count);
+        ASSERT_OK(hash_table_delete(table, keys[old]));
+        ASSERT_OK(!hash_table_insert(table, keys[new], keys[new]));
+    }
+    report("string churn", count, lookups, now() - start);
+    report_stats("after churn", table);
+    ASSERT_OK(hash_table_count(table) == count);
+
+    hash_table_destroy(table);
+    free(keys);
+}
+
+
+static void benchmark_ptrs(unsigned int count, unsigned int lookups)
+{
+    /* Aligned pointers with low bits clear, as for allocated records. */
+    void **keys = calloc(count, sizeof(void *));
+    for (unsigned int i = 0; i < count; i ++)
+        keys[i] = (void *) (uintptr_t) (0x10000 + 64 * (uintptr_t) i);
+    unsigned int *order = make_order(count, lookups);
+
+    struct hash_table *table = hash_table_create_ptrs();
+    for (unsigned int i = 0; i < count; i ++)
+        hash_table_insert(table, keys[i], keys[i]);
+
+    double start = now();
+    for (unsigned int i = 0; i < lookups; i ++)
+        ASSERT_OK(hash_table_lookup(table, keys[order[i]]));
+    report("pointer hit", count, lookups, now() - start);
+
+    hash_table_destroy(table);
+    free(keys);
+    free(order);
+}
+
+
+int main(int argc, char **argv)
+{
+    unsigned int lookups = argc > 1 ? (unsigned int) atoi(argv[1]) : 10000000;
+    static const unsigned int counts[] = { 1000, 100000, 1000000 };
+
+    printf("%u lookups\n", lookups);
+    for (unsigned int i = 0; i < ARRAY_SIZE(counts); i ++)
+    {
+        benchmark_strings(counts[i], lookups);
+        benchmark_updates(counts[i], lookups);
+        benchmark_ptrs(counts[i], lookups);
+    }
+    return 0;
+}
@@ -0,0 +1,95 @@
+/* Checks that a journal whose last line was torn by a crash is not extended by
+ * the next append.  The torn journal is loaded and a variable written and saved
+ * in a child process, then the state is loaded afresh and checked.
+ *
+ * Usage: journal_check */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "error.h"
+#include "persistence_internal.h"
+#include "persistence.h"
+
+
+#define STATE_DIR_TEMPLATE      "/tmp/journal_check.XXXXXX"
+
+
+static void write_file(const char *file_name, const char *text)
+{
+    FILE *file;
+    ASSERT_OK_IO(file = fopen(file_name, "w"));
+    ASSERT_IO(fputs(text, file));
+    ASSERT_IO(fclose(file));
+}
+
+
+static void load_state(
+    const char *state_file,
+    struct persistent_variable **a, struct persistent_variable **b)
+{
+    initialise_persistent_state(2);
+    *a = create_persistent_waveform("A", PERSISTENT_int, 1);
+    *b = create_persistent_waveform("B", PERSISTENT_int, 1);
+    set_persistence_journal(4096);
+    ASSERT_OK(!load_persistent_state(state_file, 3600, true));
+}
+
+
+/* Loads the torn journal and saves a change to B. */
+static void write_after_torn_line(const char *state_file)
+{
+    struct persistent_variable *a, *b;
+    load_state(state_file, &a, &b);
+    int value = 7;
+    write_persistent_variable(b, &value);
+    ASSERT_OK(!update_persistent_state());
+    terminate_persistent_state();
+}
+
+
+int main(int argc, char **argv)
+{
+    char state_dir[] = STATE_DIR_TEMPLATE;
+    ASSERT_OK_IO(mkdtemp(state_dir));
+    char *state_file, *journal_file;
+    ASSERT_IO(asprintf(&state_file, "%s/state", state_dir));
+    ASSERT_IO(asprintf(&journal_file, "%s.journal", state_file));
+    write_file(state_file, "A=1\n");
+    write_file(journal_file, "A=5\nA=123");
+
+    /* Persistence can only be loaded once per process. */
+    pid_t pid;
+    ASSERT_IO(pid = fork());
+    if (pid == 0)
+    {
+        write_after_torn_line(state_file);
+        exit(0);
+    }
+    int status;
+    ASSERT_IO(waitpid(pid, &status, 0));
+    ASSERT_OK(WIFEXITED(status)  &&  WEXITSTATUS(status) == 0);
+
+    /* A strict load fails if B was appended onto the torn line. */
+    struct persistent_variable *a, *b;
+    load_state(state_file, &a, &b);
+    int value_a, value_b;
+    ASSERT_OK(read_persistent_variable(a, &value_a));
+    ASSERT_OK(read_persistent_variable(b, &value_b));
+    printf("After torn journal line: A=%d B=%d\n", value_a, value_b);
+    ASSERT_OK(value_a == 5  &&  value_b == 7);
+    terminate_persistent_state();
+
+    unlink(journal_file);
+    unlink(state_file);
+    rmdir(state_dir);
+    free(journal_file);
+    free(state_file);
+    return 0;
+}
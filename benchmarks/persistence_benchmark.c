@@ -0,0 +1,245 @@
+/* Measures save and load throughput of persistent state for a large double
+ * waveform.  For comparison the raw conversion rates of number_format.c are
+ * shown alongside printf("%.17g") and strtod, which were used before.  Also
+ * checks that writing a persistent variable is not blocked while a save is
+ * being written.
+ *
+ * Usage: persistence_benchmark [waveform-length [repeats]] */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "number_format.h"
+#include "persistence_internal.h"
+#include "persistence.h"
+
+
+/* The state file starts out as an empty temporary file. */
+#define STATE_FILE_TEMPLATE     "/tmp/persistence_benchmark.XXXXXX"
+#define WAVEFORM_NAME   "BENCH:WF"
+#define SCALAR_NAME     "BENCH:SCALAR"
+
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + 1e-9 * (double) ts.tv_nsec;
+}
+
+
+static void report(
+    const char *test, unsigned int length, unsigned int repeats,
+    double duration)
+{
+    printf("%-24s %8.1f ns/value %8.2f Mvalues/s\n", test,
+        1e9 * duration / length / repeats,
+        1e-6 * length * repeats / duration);
+}
+
+
+/* A mixture of short values such as might be entered by hand and random full
+ * precision values spread over many decades. */
+static void fill_waveform(double waveform[], unsigned int length)
+{
+    static const double scales[] = { 1e-9, 1e-3, 1, 1e3, 1e12 };
+    srand(1);
+    for (unsigned int i = 0; i < length; i ++)
+    {
+        double value = (double) rand() / RAND_MAX - 0.5;
+        if (i % 2)
+            waveform[i] = value * scales[(unsigned int) rand() % 5];
+        else
+            waveform[i] = (double) (int) (1000 * value) / 100;
+    }
+}
+
+
+/* Raw conversion of the waveform to text and back again. */
+static void benchmark_conversion(
+    const double waveform[], unsigned int length, unsigned int repeats)
+{
+    char (*text)[FORMAT_NUMBER_SIZE] = calloc(length, FORMAT_NUMBER_SIZE);
+    double start;
+    double sum = 0;
+
+    start = now();
+    for (unsigned int r = 0; r < repeats; r ++)
+        for (unsigned int i = 0; i < length; i ++)
+            snprintf(text[i], FORMAT_NUMBER_SIZE, "%.17g", waveform[i]);
+    report("snprintf %.17g", length, repeats, now() - start);
+
+    start = now();
+    for (unsigned int r = 0; r < repeats; r ++)
+        for (unsigned int i = 0; i < length; i ++)
+            sum += strtod(text[i], NULL);
+    report("strtod %.17g", length, repeats, now() - start);
+
+    start = now();
+    for (unsigned int r = 0; r < repeats; r ++)
+        for (unsigned int i = 0; i < length; i ++)
+            format_double(waveform[i], text[i]);
+    report("format_double", length, repeats, now() - start);
+
+    start = now();
+    for (unsigned int r = 0; r < repeats; r ++)
+        for (unsigned int i = 0; i < length; i ++)
+            sum += parse_double(text[i], NULL);
+    report("parse_double", length, repeats, now() - start);
+
+    start = now();
+    for (unsigned int r = 0; r < repeats; r ++)
+        for (unsigned int i = 0; i < length; i ++)
+            sum += strtod(text[i], NULL);
+    report("strtod shortest", length, repeats, now() - start);
+
+    /* Check the round trip while we're here. */
+    for (unsigned int i = 0; i < length; i ++)
+        ASSERT_OK(parse_double(text[i], NULL) == waveform[i]);
+
+    printf("(checksum %g)\n", sum);
+    free(text);
+}
+
+
+/* Writes a persistent scalar as fast as possible until stopped, recording the
+ * number of writes and the longest time taken by a single write. */
+struct writer {
+    struct persistent_variable *persistence;
+    bool running;
+    unsigned int writes;
+    double max_latency;
+};
+
+static void *writer_thread(void *context)
+{
+    struct writer *writer = context;
+    while (__atomic_load_n(&writer->running, __ATOMIC_ACQUIRE))
+    {
+        double value = writer->writes;
+        double start = now();
+        write_persistent_variable(writer->persistence, &value);
+        writer->max_latency = MAX(writer->max_latency, now() - start);
+        __atomic_store_n(
+            &writer->writes, writer->writes + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+
+/* The state file is formatted and written without holding the persistence
+ * lock, so a concurrent writer should make progress throughout a save and no
+ * single write should wait for anything like the duration of the save. */
+static void check_concurrent_writes(
+    struct persistent_variable *waveform_persistence,
+    struct persistent_variable *scalar_persistence,
+    double waveform[], unsigned int length)
+{
+    struct writer writer = {
+        .persistence = scalar_persistence,
+        .running = true,
+    };
+    pthread_t thread;
+    ASSERT_PTHREAD(pthread_create(&thread, NULL, writer_thread, &writer));
+
+    /* Touch the waveform so that the save has to format it. */
+    waveform[0] += 1;
+    write_persistent_waveform(waveform_persistence, waveform, length);
+    unsigned int writes_before =
+        __atomic_load_n(&writer.writes, __ATOMIC_ACQUIRE);
+    double start = now();
+    ASSERT_OK(!update_persistent_state());
+    double save_time = now() - start;
+    unsigned int writes =
+        __atomic_load_n(&writer.writes, __ATOMIC_ACQUIRE) - writes_before;
+
+    __atomic_store_n(&writer.running, false, __ATOMIC_RELEASE);
+    ASSERT_PTHREAD(pthread_join(thread, NULL));
+
+    printf("%u writes during %.1f ms save, longest write %.3f ms\n",
+        writes, 1e3 * save_time, 1e3 * writer.max_latency);
+    /* A short save can easily complete within a single scheduler time slice,
+     * so is no test. */
+    if (save_time > 0.05)
+    {
+        ASSERT_OK(writes > 0);
+        ASSERT_OK(writer.max_latency < save_time / 2);
+    }
+    else
+        printf("(save too short to check concurrent writes)\n");
+}
+
+
+/* Saving and loading the complete state file. */
+static void benchmark_persistence(
+    double waveform[], unsigned int length, unsigned int repeats)
+{
+    initialise_persistent_state(1);
+    struct persistent_variable *persistence =
+        create_persistent_waveform(WAVEFORM_NAME, PERSISTENT_double, length);
+    struct persistent_variable *scalar_persistence =
+        create_persistent_waveform(SCALAR_NAME, PERSISTENT_double, 1);
+    char state_file[] = STATE_FILE_TEMPLATE;
+    int fd;
+    ASSERT_IO(fd = mkstemp(state_file));
+    close(fd);
+    ASSERT_OK(!load_persistent_state(state_file, 3600, true));
+
+    double save_time = 0;
+    double load_time = 0;
+    for (unsigned int r = 0; r < repeats; r ++)
+    {
+        /* Touch the waveform so that each save has to reformat it. */
+        waveform[0] = r;
+        write_persistent_waveform(persistence, waveform, length);
+
+        double start = now();
+        ASSERT_OK(!update_persistent_state());
+        save_time += now() - start;
+
+        start = now();
+        ASSERT_OK(!import_persistent_state(state_file, true));
+        load_time += now() - start;
+    }
+    report("save state file", length, repeats, save_time);
+    report("load state file", length, repeats, load_time);
+
+    double *readback = calloc(length, sizeof(double));
+    unsigned int readback_length;
+    ASSERT_OK(read_persistent_waveform(
+        persistence, readback, &readback_length));
+    ASSERT_OK(readback_length == length);
+    ASSERT_OK(memcmp(readback, waveform, length * sizeof(double)) == 0);
+    free(readback);
+
+    check_concurrent_writes(
+        persistence, scalar_persistence, waveform, length);
+
+    terminate_persistent_state();
+    unlink(state_file);
+}
+
+
+int main(int argc, char **argv)
+{
+    unsigned int length = argc > 1 ? (unsigned int) atoi(argv[1]) : 1000000;
+    unsigned int repeats = argc > 2 ? (unsigned int) atoi(argv[2]) : 5;
+
+    double *waveform = calloc(length, sizeof(double));
+    fill_waveform(waveform, length);
+
+    printf("Waveform of %u doubles, %u repeats\n", length, repeats);
+    benchmark_conversion(waveform, length, repeats);
+    benchmark_persistence(waveform, length, repeats);
+
+    free(waveform);
+    return 0;
+}
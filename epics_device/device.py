@@ -30,6 +30,7 @@ class EpicsDevice:
                     self.separator.join(self.address_prefix + [name]), 
                     file=sys.stderr)
 
+            self.record_count += 1
             return record
 
         return make
@@ -37,6 +38,7 @@ class EpicsDevice:
     def __init__(self):
         self.separator = ':'
         self.address_prefix = []
+        self.record_count = 0
         for name in [
                 'longin',    'longout',
                 'ai',        'ao',
@@ -66,6 +68,12 @@ pop_name_prefix    = EpicsDevice.pop_name_prefix
 set_name_separator = EpicsDevice.set_name_separator
 
 
+# Returns the number of EPICS device records created so far.  This can be passed
+# to initialise_epics_device so that its record table is created at full size.
+def record_count():
+    return EpicsDevice.record_count
+
+
 # Context manager for name prefix, allows us to write
 #
 #   with name_prefix(prefix):
@@ -197,9 +205,31 @@ def WaveformOut(name, *args, **fields):
     return Waveform(OutName(name), *args, **fields)
 
 
+# Creates the records published by publish_persistence_stats().  Any extra
+# fields are applied to the SAVE_TIME record, for example to set alarm limits.
+def persistence_stats(SCAN = '1 second', **fields):
+    for name, desc in [
+            ('VARIABLES',   'Number of persistent variables'),
+            ('DIRTY',       'Variables changed since last save'),
+            ('SAVES',       'Number of saves since startup'),
+            ('WAITS',       'Times records waited for lock')]:
+        longIn(name, SCAN = SCAN, DESC = desc)
+    for name, EGU, desc in [
+            ('BYTES',       'B', 'Storage used by persistent variables'),
+            ('SAVE_BYTES',  'B', 'Bytes written by last save'),
+            ('WRITTEN',     'B', 'Bytes written since startup'),
+            ('LOAD_TIME',   's', 'Time taken to load state'),
+            ('WAIT_TIME',   's', 'Total time records waited for lock'),
+            ('WAIT_MAX',    's', 'Longest wait for lock'),
+            ('FLUSH_TIME',  's', 'Latency of last flush')]:
+        aIn(name, EGU = EGU, PREC = 3, SCAN = SCAN, DESC = desc)
+    fields.setdefault('DESC', 'Duration of last save')
+    return aIn('SAVE_TIME', EGU = 's', PREC = 3, SCAN = SCAN, **fields)
+
+
 __all__ = [
     'aIn',      'aOut',     'boolIn',   'boolOut',  'longIn',   'longOut',
     'mbbIn',    'mbbOut',   'stringIn', 'stringOut',
-    'Waveform', 'WaveformOut',
+    'Waveform', 'WaveformOut',  'persistence_stats',
     'EpicsDevice', 'set_MDEL_default', 'set_out_name',
-    'push_name_prefix', 'pop_name_prefix', 'name_prefix']
+    'push_name_prefix', 'pop_name_prefix', 'name_prefix', 'record_count']
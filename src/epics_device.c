@@ -12,6 +12,7 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <inttypes.h>
 #include <pthread.h>
 
 #include <devSup.h>
@@ -40,9 +41,12 @@
 #include <dbAddr.h>
 #include <dbAccessDefs.h>
 #include <dbLock.h>
+#include <callback.h>
+#include <epicsVersion.h>
 
 #include "error.h"
 #include "hashtable.h"
+#include "hashtable_typed.h"
 #include "persistence_internal.h"
 #include "epics_extra_internal.h"
 
@@ -55,6 +59,11 @@
 #define NO_CONVERT      2       // Special code for ai/ao conversion
 
 
+/* Backwards link tracking, which we use for lazy records, was added to EPICS in
+ * version 3.16. */
+#define BASE_3_16 (EPICS_VERSION * 100 + EPICS_REVISION >= 316)
+
+
 /* Maximum length of record prefix. */
 #define MAX_NAME_PREFIX_COUNT       8
 #define MAX_NAME_PREFIX_LENGTH      80
@@ -65,7 +74,13 @@
 /*                   Core Record Publishing and Lookup                      */
 /****************************************************************************/
 
-static struct hash_table *hash_table = NULL;
+/* All published records indexed by their key.  Records are looked up from many
+ * threads, and can be published at any time, so lookups are lock free. */
+struct epics_record;
+DEFINE_CONCURRENT_HASH_TABLE(record_table,
+    const char *, struct epics_record *, hash_string_key, compare_string_key)
+
+static struct record_table *record_table = NULL;
 
 /* Mutex used to initialise record if not specified in record initialiser. */
 static pthread_mutex_t *default_mutex = NULL;
@@ -83,7 +98,7 @@ struct epics_record {
     /* The following fields are shared between pairs of record classes. */
     IOSCANPVT ioscanpvt;            // Used for I/O intr enabled records
     bool ioscan_pending;            // Set for early record triggering
-    bool persist;                   // Set for persistently written data
+    struct persistent_variable *persistence;  // Set for persistent data
     enum epics_alarm_severity severity;    // Reported record status
     void *context;                  // Context for all user callbacks
     pthread_mutex_t *mutex;         // Lock for record processing
@@ -98,12 +113,22 @@ struct epics_record {
             bool (*read)(void *context, void *result);
             struct timespec timestamp;  // Timestamp explicitly set
             bool set_time;              // Whether to use timestamp
+            bool lazy;                  // Skip read if nobody is listening
+            bool stale;                 // Restored value not yet read
+            void *persisted_value;      // Last value written to persistence
+            bool persisted;             // Set once persisted_value is valid
+            uint64_t read_count;        // Lazy processing count
+            uint64_t skip_count;        // Number of skipped lazy reads
         } in;
         // OUT record support
         struct {
             bool (*write)(void *context, void *value);
             bool (*init)(void *context, void *result);
             void *save_value;       // Used to restore after rejected write
+            struct write_group *group;  // Set if writes are staged
+            void *staged_value;     // Value waiting for group commit
+            bool staged;            // Set if record is on the staged list
+            struct epics_record *next_staged;
         } out;
         // WAVEFORM record support
         struct {
@@ -137,12 +162,35 @@ static size_t write_data_size(enum record_type record_type)
 }
 
 
+/* Returns the size of the value read by an IN record. */
+static size_t read_data_size(enum record_type record_type)
+{
+    switch (record_type)
+    {
+        case RECORD_TYPE_longin:    return sizeof(TYPEOF(longin));
+        case RECORD_TYPE_ulongin:   return sizeof(TYPEOF(ulongin));
+        case RECORD_TYPE_ai:        return sizeof(TYPEOF(ai));
+        case RECORD_TYPE_bi:        return sizeof(TYPEOF(bi));
+        case RECORD_TYPE_stringin:  return sizeof(TYPEOF(stringin));
+        case RECORD_TYPE_mbbi:      return sizeof(TYPEOF(mbbi));
+        default: ASSERT_FAIL();
+    }
+}
+
+
 /* The types used here must match the types used for record interfacing. */
 static enum PERSISTENCE_TYPES record_type_to_persistence(
     enum record_type record_type)
 {
     switch (record_type)
     {
+        case RECORD_TYPE_longin:    return PERSISTENT_int;
+        case RECORD_TYPE_ulongin:   return PERSISTENT_int;
+        case RECORD_TYPE_ai:        return PERSISTENT_double;
+        case RECORD_TYPE_bi:        return PERSISTENT_bool;
+        case RECORD_TYPE_stringin:  return PERSISTENT_string;
+        case RECORD_TYPE_mbbi:      return PERSISTENT_short;
+
         case RECORD_TYPE_longout:   return PERSISTENT_int;
         case RECORD_TYPE_ulongout:  return PERSISTENT_int;
         case RECORD_TYPE_ao:        return PERSISTENT_double;
@@ -289,9 +337,21 @@ static void initialise_in_fields(
 {
     base->in.set_time = in_args->set_time;
     base->in.read = in_args->read;
+    base->in.lazy = in_args->lazy;
+    base->in.stale = false;
+    base->in.persisted_value = NULL;
+    base->in.persisted = false;
+    base->in.read_count = 0;
+    base->in.skip_count = 0;
     base->max_length = 1;
     base->context = in_args->context;
     base->mutex = in_args->mutex ?: default_mutex;
+    if (in_args->persist)
+    {
+        base->persistence = create_persistent_waveform(base->key,
+            record_type_to_persistence(base->record_type), 1);
+        base->in.persisted_value = malloc(read_data_size(base->record_type));
+    }
     if (in_args->io_intr)
         scanIoInit(&base->ioscanpvt);
 }
@@ -302,12 +362,17 @@ static void initialise_out_fields(
     base->out.write = out_args->write;
     base->out.init = out_args->init;
     base->out.save_value = malloc(write_data_size(base->record_type));
+    base->out.group = out_args->group;
+    base->out.staged_value = NULL;
+    base->out.staged = false;
+    base->out.next_staged = NULL;
+    if (base->out.group)
+        base->out.staged_value = malloc(write_data_size(base->record_type));
     base->max_length = 1;
     base->context = out_args->context;
     base->mutex = out_args->mutex ?: default_mutex;
-    base->persist = out_args->persist;
-    if (base->persist)
-        create_persistent_waveform(base->key,
+    if (out_args->persist)
+        base->persistence = create_persistent_waveform(base->key,
             record_type_to_persistence(base->record_type), 1);
 }
 
@@ -320,9 +385,8 @@ static void initialise_waveform_fields(
     base->max_length = waveform_args->max_length;
     base->context = waveform_args->context;
     base->mutex = waveform_args->mutex ?: default_mutex;
-    base->persist = waveform_args->persist;
-    if (base->persist)
-        create_persistent_waveform(base->key,
+    if (waveform_args->persist)
+        base->persistence = create_persistent_waveform(base->key,
             waveform_type_to_persistence(waveform_args->field_type),
             waveform_args->max_length);
     if (waveform_args->io_intr)
@@ -345,7 +409,7 @@ struct epics_record *publish_epics_record(
     base->record_name = NULL;
     base->ioscanpvt = NULL;
     base->ioscan_pending = false;
-    base->persist = false;
+    base->persistence = NULL;
     base->severity = (enum epics_alarm_severity) epicsSevNone;
     base->disable_write = false;
 
@@ -366,8 +430,10 @@ struct epics_record *publish_epics_record(
             break;
     }
 
-    void *old_key = hash_table_insert(hash_table, base->key, base);
-    fail_on_error(TEST_OK_(!old_key, "Record \"%s\" already exists!", key));
+    struct epics_record *old_record =
+        record_table_add(record_table, base->key, base);
+    fail_on_error(
+        TEST_OK_(!old_record, "Record \"%s\" already exists!", key));
     return base;
 }
 
@@ -376,22 +442,28 @@ struct epics_record *lookup_epics_record(
     enum record_type record_type, const char *name)
 {
     BUILD_KEY(key, name, record_type);
-    struct epics_record *result = hash_table_lookup(hash_table, key);
+    struct epics_record *result = record_table_lookup(record_table, key);
     fail_on_error(TEST_OK_(result, "Lookup %s failed", key));
     return result;
 }
 
 
-/* Checks whether the given record is an IN record for validating the trigger
- * and other update methods. */
-static bool is_in_or_waveform(struct epics_record *base)
+bool read_record_persistence(struct epics_record *record, void *value)
+{
+    return
+        record->persistence  &&
+        read_persistent_variable(record->persistence, value);
+}
+
+
+/* Checks whether the given record type is an IN record. */
+static bool is_in_record(enum record_type record_type)
 {
-    switch (base->record_type)
+    switch (record_type)
     {
         case RECORD_TYPE_longin:    case RECORD_TYPE_ulongin:
         case RECORD_TYPE_ai:        case RECORD_TYPE_bi:
         case RECORD_TYPE_stringin:  case RECORD_TYPE_mbbi:
-        case RECORD_TYPE_waveform:
             return true;
         default:
             return false;
@@ -399,6 +471,16 @@ static bool is_in_or_waveform(struct epics_record *base)
 }
 
 
+/* Checks whether the given record is an IN record for validating the trigger
+ * and other update methods. */
+static bool is_in_or_waveform(struct epics_record *base)
+{
+    return
+        is_in_record(base->record_type)  ||
+        base->record_type == RECORD_TYPE_waveform;
+}
+
+
 void set_record_severity(
     struct epics_record *base, enum epics_alarm_severity severity)
 {
@@ -436,38 +518,24 @@ static void init_hook(initHookState state)
          * trigger_record events signalled before this point have simply been
          * ignored.  We'll walk the complete record database and retrigger them
          * now.  Fortunately we'll only ever get this event the once. */
-        const void *key;
-        void *value;
-        for (int ix = 0; hash_table_walk(hash_table, &ix, &key, &value); )
+        struct record_table_cursor cursor =
+            record_table_walk_start(record_table);
+        struct epics_record *base;
+        while (record_table_walk(&cursor, NULL, &base))
         {
-            const struct epics_record *base = value;
             if (base->ioscan_pending  &&  base->ioscanpvt)
                 scanIoRequest(base->ioscanpvt);
         }
     }
 }
 
-error__t initialise_epics_device(void)
-{
-    if (hash_table == NULL)
-    {
-        hash_table = hash_table_create(false);
-        initHookRegister(init_hook);
-        initialise_epics_extra();
-        initialise_persistent_state();
-    }
-    return ERROR_OK;
-}
-
-
 unsigned int check_unused_record_bindings(bool verbose)
 {
-    int hash_ix = 0;
-    void *value;
+    struct record_table_cursor cursor = record_table_walk_start(record_table);
+    struct epics_record *record;
     unsigned int count = 0;
-    while (hash_table_walk(hash_table, &hash_ix, NULL, &value))
+    while (record_table_walk(&cursor, NULL, &record))
     {
-        struct epics_record *record = value;
         if (!record->record_name)
         {
             count += 1;
@@ -479,6 +547,34 @@ unsigned int check_unused_record_bindings(bool verbose)
 }
 
 
+void report_lazy_reads(bool verbose)
+{
+    struct record_table_cursor cursor = record_table_walk_start(record_table);
+    struct epics_record *record;
+    unsigned int records = 0;
+    uint64_t reads = 0;
+    uint64_t skipped = 0;
+    while (record_table_walk(&cursor, NULL, &record))
+    {
+        if (is_in_record(record->record_type)  &&  record->in.lazy)
+        {
+            uint64_t read_count =
+                __atomic_load_n(&record->in.read_count, __ATOMIC_RELAXED);
+            uint64_t skip_count =
+                __atomic_load_n(&record->in.skip_count, __ATOMIC_RELAXED);
+            records += 1;
+            reads += read_count;
+            skipped += skip_count;
+            if (verbose)
+                printf("%s: %"PRIu64" of %"PRIu64" reads skipped\n",
+                    record->key, skip_count, read_count);
+        }
+    }
+    printf("%u lazy records: %"PRIu64" of %"PRIu64" reads skipped\n",
+        records, skipped, reads);
+}
+
+
 pthread_mutex_t *set_default_epics_device_mutex(pthread_mutex_t *mutex)
 {
     pthread_mutex_t *old_mutex = default_mutex;
@@ -487,6 +583,109 @@ pthread_mutex_t *set_default_epics_device_mutex(pthread_mutex_t *mutex)
 }
 
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/*                               Struct readers                              */
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/* A struct reader publishes one IN record for each field of a structure, all
+ * sharing a single I/O Intr scan.  The first record processed after a trigger
+ * calls the reader to refresh the whole structure, and every record then copies
+ * its own field out of the cached structure. */
+struct epics_struct_reader {
+    bool (*read)(void *context, void *value);
+    void *context;
+    pthread_mutex_t *read_mutex;    // Caller's mutex for calling read
+    pthread_mutex_t mutex;          // Guards refresh, ok and value
+    IOSCANPVT ioscanpvt;            // Shared by all field records
+    struct epics_record *first;     // Used for early triggering
+    bool refresh;                   // Set by trigger_struct_reader
+    bool ok;                        // Result of last call to read
+    unsigned int field_count;
+    struct struct_field_context {
+        struct epics_struct_reader *reader;
+        size_t offset;
+        size_t size;
+    } *fields;
+    char value[];                   // Structure filled by read
+};
+
+
+/* Read method for each field record.  This is called with reader->mutex held,
+ * as this is the record mutex. */
+static bool read_struct_field(void *context, void *result)
+{
+    struct struct_field_context *field = context;
+    struct epics_struct_reader *reader = field->reader;
+    if (reader->refresh)
+    {
+        if (reader->read_mutex)  pthread_mutex_lock(reader->read_mutex);
+        reader->ok = reader->read(reader->context, reader->value);
+        if (reader->read_mutex)  pthread_mutex_unlock(reader->read_mutex);
+        reader->refresh = false;
+    }
+    memcpy(result, reader->value + field->offset, field->size);
+    return reader->ok;
+}
+
+
+struct epics_struct_reader *_publish_struct_reader(
+    size_t size, const struct struct_field fields[], unsigned int count,
+    const struct struct_reader_args *args)
+{
+    ASSERT_OK(count > 0);
+    struct epics_struct_reader *reader =
+        malloc(sizeof(struct epics_struct_reader) + size);
+    *reader = (struct epics_struct_reader) {
+        .read = args->read,
+        .context = args->context,
+        .read_mutex = args->mutex ?: default_mutex,
+        .field_count = count,
+        .fields = calloc(count, sizeof(struct struct_field_context)),
+    };
+    memset(reader->value, 0, size);
+    ASSERT_PTHREAD(pthread_mutex_init(&reader->mutex, NULL));
+    scanIoInit(&reader->ioscanpvt);
+
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        const struct struct_field *field = &fields[i];
+        ASSERT_OK(is_in_record(field->record_type));
+        struct struct_field_context *context = &reader->fields[i];
+        *context = (struct struct_field_context) {
+            .reader = reader,
+            .offset = field->offset,
+            .size = read_data_size(field->record_type),
+        };
+        ASSERT_OK(context->offset + context->size <= size);
+
+        /* Each field record shares the reader's scan and is processed under
+         * the reader's own mutex. */
+        struct epics_record *base = publish_epics_record(
+            field->record_type, field->name,
+            &(struct record_args_in) {
+                .read = read_struct_field,
+                .context = context,
+                .mutex = &reader->mutex,
+            });
+        base->ioscanpvt = reader->ioscanpvt;
+        if (i == 0)
+            reader->first = base;
+    }
+    return reader;
+}
+
+
+void trigger_struct_reader(struct epics_struct_reader *reader)
+{
+    WITH_MUTEX(reader->mutex)
+        reader->refresh = true;
+    /* If triggered before interrupts are enabled this will be ignored, so
+     * flag one of our records for retriggering by init_hook. */
+    reader->first->ioscan_pending = true;
+    scanIoRequest(reader->ioscanpvt);
+}
+
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /*                 Support for direct writing to OUT records                 */
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
@@ -546,12 +745,12 @@ static short waveform_type_dbr(enum waveform_type waveform_type)
 
 
 /* Used to convert an internal record name to the associated dbaddr value and
- * performs sanity validation.  If this fails we just die! */
-static void record_to_dbaddr(
+ * performs sanity validation. */
+static error__t get_record_dbaddr(
     enum record_type record_type, struct epics_record *record,
     unsigned int length, struct dbAddr *dbaddr)
 {
-    fail_on_error(
+    return
         TEST_OK_(record->record_type == record_type,
             "%s is %s (%d), not %s (%d)", record->key,
             get_type_name(record->record_type), record->record_type,
@@ -561,28 +760,45 @@ static void record_to_dbaddr(
         // The writing API needs a dbAddr to describe the target
         TEST_OK(record->record_name)  ?:
         TEST_OK_(dbNameToAddr(record->record_name, dbaddr) == 0,
-            "Unable to find record %s", record->record_name));
+            "Unable to find record %s", record->record_name);
 }
 
 
-/* Wrapper around dbPutField to write value to EPICS database. */
-static bool _write_out_record(
+/* As for get_record_dbaddr(), but if this fails we just die! */
+static void record_to_dbaddr(
     enum record_type record_type, struct epics_record *record,
-    short dbr_type, const void *value, unsigned int length, bool process)
+    unsigned int length, struct dbAddr *dbaddr)
 {
-    struct dbAddr dbaddr;
-    record_to_dbaddr(record_type, record, length, &dbaddr);
+    fail_on_error(get_record_dbaddr(record_type, record, length, dbaddr));
+}
+
 
-    /* Write the desired value under the database lock: we disable writing if
-     * processing was not requested. */
-    dbScanLock(dbaddr.precord);
+/* Wrapper around dbPutField to write value to EPICS database.  Writing is done
+ * under the database lock: we disable writing if processing was not
+ * requested. */
+static bool put_record_value(
+    struct epics_record *record, struct dbAddr *dbaddr,
+    short dbr_type, const void *value, unsigned int length, bool process)
+{
+    dbScanLock(dbaddr->precord);
     record->disable_write = !process;
-    bool put_ok = dbPutField(&dbaddr, dbr_type, value, (long) length) == 0;
+    bool put_ok = dbPutField(dbaddr, dbr_type, value, (long) length) == 0;
     record->disable_write = false;
-    dbScanUnlock(dbaddr.precord);
+    dbScanUnlock(dbaddr->precord);
     return put_ok;
 }
 
+
+static bool _write_out_record(
+    enum record_type record_type, struct epics_record *record,
+    short dbr_type, const void *value, unsigned int length, bool process)
+{
+    struct dbAddr dbaddr;
+    record_to_dbaddr(record_type, record, length, &dbaddr);
+    return put_record_value(
+        record, &dbaddr, dbr_type, value, length, process);
+}
+
 bool _write_out_record_value(
     enum record_type record_type, struct epics_record *record,
     const void *value, bool process)
@@ -605,6 +821,62 @@ bool _write_out_record_waveform(
 }
 
 
+/* Restores a persistent variable from a named snapshot.  Once the record is
+ * bound the value is written through the record, so that it is processed
+ * exactly as if written externally; before this only the persistent variable
+ * is updated, and will be read when the record is initialised.  The same is
+ * done for persistent variables which don't belong to a record.  IN records
+ * only hold readbacks and are left alone.  Failures are reported rather than
+ * being fatal, as restoring can be requested from the IOC shell. */
+static bool restore_persistent_record(
+    struct persistent_variable *persistence, const char *key,
+    const void *value, unsigned int length)
+{
+    struct epics_record *base = record_table_lookup(record_table, key);
+    if (base  &&  is_in_record(base->record_type))
+        return true;
+    else if (base == NULL  ||  base->record_name == NULL)
+    {
+        write_persistent_waveform(persistence, value, length);
+        return true;
+    }
+    else
+    {
+        short dbr_type = base->record_type == RECORD_TYPE_waveform ?
+            waveform_type_dbr(base->waveform.field_type) :
+            record_type_dbr(base->record_type);
+        struct dbAddr dbaddr;
+        return !error_report(
+            get_record_dbaddr(base->record_type, base, length, &dbaddr)  ?:
+            TEST_OK_(put_record_value(
+                base, &dbaddr, dbr_type, value, length, true),
+                "Unable to restore %s", key));
+    }
+}
+
+
+error__t initialise_epics_device_capacity(
+    unsigned int record_count, unsigned int persistent_count)
+{
+    if (record_table == NULL)
+    {
+        record_table = record_table_create();
+        initHookRegister(init_hook);
+        initialise_epics_extra();
+        set_persistence_restore(restore_persistent_record);
+    }
+    record_table_reserve(record_table, record_count);
+    initialise_persistent_state(persistent_count);
+    return ERROR_OK;
+}
+
+
+error__t initialise_epics_device(void)
+{
+    return initialise_epics_device_capacity(0, 0);
+}
+
+
 /* Wrapper around dbGetField to read value from EPICS. */
 static void _read_record(
     enum record_type record_type, struct epics_record *record,
@@ -705,6 +977,11 @@ bool _publish_action_bo(void *context, bool *value)
     return true;
 }
 
+bool _publish_commit_bo(void *context, bool *value)
+{
+    return commit_write_group(context);
+}
+
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Waveform adapters. */
@@ -778,13 +1055,19 @@ void _publish_waveform_action(void *context, void *array, unsigned int *length)
 /*****************************************************************************/
 
 static __thread struct epics_record *current_epics_record = NULL;
+/* The record mutex held by this thread while calling the current record, if
+ * any.  This is not held while initialising a record. */
+static __thread pthread_mutex_t *current_record_mutex = NULL;
 
 /* Need to allow for possibility of recursion during record procession. */
-#define PUSH_CURRENT_RECORD(record) \
+#define PUSH_CURRENT_RECORD(record, mutex) \
     struct epics_record *_saved_record = current_epics_record; \
-    current_epics_record = record
+    pthread_mutex_t *_saved_mutex = current_record_mutex; \
+    current_epics_record = record; \
+    current_record_mutex = mutex
 #define POP_CURRENT_RECORD(record) \
-    current_epics_record = _saved_record
+    current_epics_record = _saved_record; \
+    current_record_mutex = _saved_mutex
 
 
 struct epics_record *get_current_epics_record(void)
@@ -799,7 +1082,7 @@ static error__t init_record_common(
     dbCommon *pr, const char *name, enum record_type record_type)
 {
     BUILD_KEY(key, name, record_type);
-    struct epics_record *base = hash_table_lookup(hash_table, key);
+    struct epics_record *base = record_table_lookup(record_table, key);
     return
         TEST_OK_(base, "No handler found for %s", key)  ?:
         TEST_OK_(base->record_name == NULL,
@@ -862,19 +1145,102 @@ static error__t init_in_record(dbCommon *pr)
             base->in.set_time, pr->tse, base->key);
 }
 
+/* A persistent IN record starts with its last saved value, which is flagged as
+ * stale with a minor read alarm.  The alarm is only cleared when the record
+ * successfully reads a fresh value, lazy processing which skips the read leaves
+ * the value stale. */
+static bool init_in_persistence(dbCommon *pr, void *result)
+{
+    struct epics_record *base = pr->dpvt;
+    if (base->persistence  &&
+        read_persistent_variable(base->persistence, result))
+    {
+        memcpy(base->in.persisted_value, result,
+            read_data_size(base->record_type));
+        base->in.persisted = true;
+        base->in.stale = true;
+        pr->udf = false;
+        pr->stat = READ_ALARM;
+        pr->sevr = epicsSevMinor;
+        struct timespec timestamp;
+        clock_gettime(CLOCK_REALTIME, &timestamp);
+        epicsTimeFromTimespec(&pr->time, &timestamp);
+    }
+    return true;
+}
+
+/* A lazy record only needs to be read if something can see the result.  We
+ * check for monitors (which covers Channel Access clients and CA links), a put
+ * to the record, a forward link, and, where EPICS supports it, database links
+ * from other records.  A caget of a record with no monitors will see a stale
+ * value.
+ *
+ * The counts are updated without taking the record mutex, which a record
+ * need not have, so are updated and read atomically. */
+static bool skip_lazy_read(struct epics_record *base, dbCommon *pr)
+{
+    if (!base->in.lazy)
+        return false;
+
+    __atomic_fetch_add(&base->in.read_count, 1, __ATOMIC_RELAXED);
+    bool has_clients =
+        ellCount(&pr->mlis) > 0  ||
+        pr->putf  ||
+        pr->flnk.type == DB_LINK  ||  pr->flnk.type == CA_LINK  ||
+#if BASE_3_16
+        ellCount(&pr->bklnk) > 0  ||
+#endif
+        false;
+    if (!has_clients)
+        __atomic_fetch_add(&base->in.skip_count, 1, __ATOMIC_RELAXED);
+    return !has_clients;
+}
+
+
+/* Readbacks are mostly unchanged from one read to the next, so we keep a copy
+ * of the last value written to persistence and only write a changed value,
+ * saving taking the persistence lock on every read.  Record processing is
+ * serialised by EPICS, so no lock is needed here. */
+static void update_in_persistence(struct epics_record *base, const void *value)
+{
+    size_t value_size = read_data_size(base->record_type);
+    if (!base->in.persisted  ||
+        memcmp(base->in.persisted_value, value, value_size))
+    {
+        write_persistent_variable(base->persistence, value);
+        memcpy(base->in.persisted_value, value, value_size);
+        base->in.persisted = true;
+    }
+}
+
+
 static bool process_in_record(dbCommon *pr, void *result)
 {
     struct epics_record *base = pr->dpvt;
     if (base == NULL)
         return false;
 
-    if (base->mutex)  pthread_mutex_lock(base->mutex);
-    PUSH_CURRENT_RECORD(base);
-    bool ok = base->in.read(base->context, result);
-    POP_CURRENT_RECORD();
-    if (base->mutex)  pthread_mutex_unlock(base->mutex);
+    /* If the read is skipped we leave the current value in place, which is
+     * still valid unless the record has never been read. */
+    bool ok;
+    if (skip_lazy_read(base, pr))
+        ok = !pr->udf;
+    else
+    {
+        if (base->mutex)  pthread_mutex_lock(base->mutex);
+        PUSH_CURRENT_RECORD(base, base->mutex);
+        ok = base->in.read(base->context, result);
+        POP_CURRENT_RECORD();
+        if (base->mutex)  pthread_mutex_unlock(base->mutex);
+        if (ok  &&  base->persistence)
+            update_in_persistence(base, result);
+        if (ok)
+            base->in.stale = false;
+    }
 
     recGblSetSevr(pr, READ_ALARM, base->severity);
+    if (base->in.stale)
+        recGblSetSevr(pr, READ_ALARM, epicsSevMinor);
     if (base->in.set_time)
         epicsTimeFromTimespec(&pr->time, &base->in.timestamp);
     pr->udf = !ok;
@@ -889,18 +1255,20 @@ static bool process_in_record(dbCommon *pr, void *result)
         return ok ? PROC_OK : EPICS_ERROR; \
     }
 
-#define DEFINE_INIT_IN(record) \
+#define DEFINE_INIT_IN(record, ADAPTER) \
     static long init_record_##record(record##Record *pr) \
     { \
         error__t error = \
             init_record_common((dbCommon *) pr, \
                 pr->inp.value.instio.string, RECORD_TYPE_##record)  ?: \
-            init_in_record((dbCommon *) pr); \
+            init_in_record((dbCommon *) pr)  ?: \
+            DO(ADAPTER(init_in_persistence, \
+                TYPEOF(record), pr->val, (dbCommon *) pr)); \
         return error_report(error) ? EPICS_ERROR : EPICS_OK; \
     }
 
 #define DEFINE_DEFAULT_IN(record, PROC_OK, ADAPTER) \
-    DEFINE_INIT_IN(record) \
+    DEFINE_INIT_IN(record, ADAPTER) \
     DEFINE_PROCESS_IN(record, PROC_OK, ADAPTER)
 
 
@@ -928,9 +1296,10 @@ static void post_init_process(dbCommon *pr)
 static bool init_out_record(dbCommon *pr, unsigned int value_size, void *result)
 {
     struct epics_record *base = pr->dpvt;
-    PUSH_CURRENT_RECORD(base);
+    PUSH_CURRENT_RECORD(base, NULL);
     bool read_ok =
-        (base->persist   &&  read_persistent_variable(base->key, result))  ||
+        (base->persistence  &&
+            read_persistent_variable(base->persistence, result))  ||
         (base->out.init  &&  base->out.init(base->context, result));
     POP_CURRENT_RECORD();
     if (read_ok)
@@ -943,6 +1312,274 @@ static bool init_out_record(dbCommon *pr, unsigned int value_size, void *result)
 }
 
 
+/* Staged writes are collected in a write group in the order they are written
+ * until the group is committed or discarded. */
+struct write_group {
+    bool (*commit)(void *context);
+    void *context;
+    pthread_mutex_t mutex;          // Guards the staged list
+    unsigned int staged_count;
+    struct epics_record *first_staged;
+    struct epics_record **last_staged;
+};
+
+
+struct write_group *create_write_group(
+    bool (*commit)(void *context), void *context)
+{
+    struct write_group *group = malloc(sizeof(struct write_group));
+    *group = (struct write_group) {
+        .commit = commit,
+        .context = context,
+    };
+    group->last_staged = &group->first_staged;
+    ASSERT_PTHREAD(pthread_mutex_init(&group->mutex, NULL));
+    return group;
+}
+
+
+/* Adds the record to the staged list if necessary and records the value to be
+ * written on commit. */
+static void stage_write(
+    struct epics_record *base, const void *value, unsigned int value_size)
+{
+    struct write_group *group = base->out.group;
+    WITH_MUTEX(group->mutex)
+    {
+        memcpy(base->out.staged_value, value, value_size);
+        if (!base->out.staged)
+        {
+            base->out.staged = true;
+            base->out.next_staged = NULL;
+            *group->last_staged = base;
+            group->last_staged = &base->out.next_staged;
+            group->staged_count += 1;
+        }
+    }
+}
+
+
+/* A staged write taken from the group for committing, with a private copy of
+ * the value, so that the record can be staged again while the group is being
+ * committed.  Also used to defer restoring records after a failed commit. */
+struct staged_writes {
+    CALLBACK callback;
+    unsigned int count;
+    struct staged_write {
+        struct epics_record *base;
+        void *value;
+    } writes[];
+};
+
+
+/* Empties the staged list, returning the staged writes in order of staging.
+ * Must be called with the group mutex held. */
+static struct staged_writes *take_staged_writes(struct write_group *group)
+{
+    struct staged_writes *writes = malloc(
+        sizeof(struct staged_writes) +
+        group->staged_count * sizeof(struct staged_write));
+    writes->count = group->staged_count;
+    struct epics_record *base = group->first_staged;
+    for (unsigned int i = 0; i < group->staged_count; i ++)
+    {
+        size_t value_size = write_data_size(base->record_type);
+        writes->writes[i] = (struct staged_write) {
+            .base = base,
+            .value = malloc(value_size),
+        };
+        memcpy(writes->writes[i].value, base->out.staged_value, value_size);
+        base->out.staged = false;
+        base = base->out.next_staged;
+    }
+    group->staged_count = 0;
+    group->first_staged = NULL;
+    group->last_staged = &group->first_staged;
+    return writes;
+}
+
+
+/* Replaces each staged value with the last committed value of its record.  Must
+ * be called with the group mutex held. */
+static void take_committed_values(struct staged_writes *writes)
+{
+    for (unsigned int i = 0; i < writes->count; i ++)
+    {
+        struct staged_write *write = &writes->writes[i];
+        memcpy(write->value, write->base->out.save_value,
+            write_data_size(write->base->record_type));
+    }
+}
+
+
+static void free_staged_writes(struct staged_writes *writes)
+{
+    for (unsigned int i = 0; i < writes->count; i ++)
+        free(writes->writes[i].value);
+    free(writes);
+}
+
+
+/* Calls the record writer with the given value.  Must be called with no record
+ * mutex held. */
+static bool write_staged_value(struct epics_record *base, void *value)
+{
+    if (base->mutex)  pthread_mutex_lock(base->mutex);
+    PUSH_CURRENT_RECORD(base, base->mutex);
+    bool ok = base->out.write(base->context, value);
+    POP_CURRENT_RECORD();
+    if (base->mutex)  pthread_mutex_unlock(base->mutex);
+    return ok;
+}
+
+
+/* There is no ordering between record mutexes, so to avoid deadlock between
+ * concurrent commits no record mutex may be held while taking another.  A
+ * commit from record processing is called with the calling record's mutex
+ * held, so this is released while staged values are written. */
+static pthread_mutex_t *release_caller_mutex(void)
+{
+    pthread_mutex_t *mutex = current_record_mutex;
+    if (mutex)
+    {
+        pthread_mutex_unlock(mutex);
+        current_record_mutex = NULL;
+    }
+    return mutex;
+}
+
+static void reacquire_caller_mutex(pthread_mutex_t *mutex)
+{
+    if (mutex)
+    {
+        pthread_mutex_lock(mutex);
+        current_record_mutex = mutex;
+    }
+}
+
+
+/* Writes each staged value back to its record without calling write, and
+ * releases the staged writes.  As this can be called from a callback thread
+ * failures are reported and counted rather than being fatal. */
+static void restore_records(struct staged_writes *writes)
+{
+    unsigned int failed = 0;
+    for (unsigned int i = 0; i < writes->count; i ++)
+    {
+        struct epics_record *base = writes->writes[i].base;
+        struct dbAddr dbaddr;
+        if (error_report(
+                get_record_dbaddr(base->record_type, base, 1, &dbaddr)  ?:
+                TEST_OK_(put_record_value(
+                    base, &dbaddr, record_type_dbr(base->record_type),
+                    writes->writes[i].value, 1, false),
+                    "Unable to restore %s", base->key)))
+            failed += 1;
+    }
+    if (failed > 0)
+        printf("Failed to restore %u of %u records after failed commit\n",
+            failed, writes->count);
+    free_staged_writes(writes);
+}
+
+
+static void restore_records_callback(CALLBACK *callback)
+{
+    struct staged_writes *writes;
+    callbackGetUser(writes, callback);
+    restore_records(writes);
+}
+
+
+/* Restores records through the database.  During record processing the
+ * database lock of the processing record is held, and taking the locks of the
+ * restored records as well could deadlock, so in this case restoring is
+ * deferred to an EPICS callback thread. */
+static void restore_staged_records(struct staged_writes *writes)
+{
+    if (current_epics_record)
+    {
+        callbackSetCallback(restore_records_callback, &writes->callback);
+        callbackSetPriority(priorityLow, &writes->callback);
+        callbackSetUser(writes, &writes->callback);
+        if (error_report(TEST_OK_(callbackRequest(&writes->callback) == 0,
+                "Unable to restore records after failed commit")))
+            free_staged_writes(writes);
+    }
+    else
+        restore_records(writes);
+}
+
+
+/* To avoid deadlock record mutexes are never taken while the group mutex is
+ * held, so the staged writes are taken from the group before they are written.
+ * The group mutex is held again while calling the commit method so that the
+ * commit method is never called concurrently. */
+bool commit_write_group(struct write_group *group)
+{
+    struct staged_writes *writes;
+    WITH_MUTEX(group->mutex)
+        writes = take_staged_writes(group);
+
+    pthread_mutex_t *caller_mutex = release_caller_mutex();
+    bool ok = true;
+    unsigned int written = 0;
+    while (ok  &&  written < writes->count)
+    {
+        struct staged_write *write = &writes->writes[written];
+        ok = write_staged_value(write->base, write->value);
+        if (ok)
+            written += 1;
+    }
+
+    WITH_MUTEX(group->mutex)
+    {
+        if (ok  &&  group->commit)
+            ok = group->commit(group->context);
+
+        if (ok)
+        {
+            for (unsigned int i = 0; i < writes->count; i ++)
+            {
+                struct staged_write *write = &writes->writes[i];
+                struct epics_record *base = write->base;
+                memcpy(base->out.save_value, write->value,
+                    write_data_size(base->record_type));
+                if (base->persistence)
+                    write_persistent_variable(base->persistence, write->value);
+            }
+        }
+        else
+            take_committed_values(writes);
+    }
+
+    if (ok)
+        free_staged_writes(writes);
+    else
+    {
+        /* Put the driver back to the last committed state. */
+        for (unsigned int i = 0; i < written; i ++)
+            write_staged_value(
+                writes->writes[i].base, writes->writes[i].value);
+        restore_staged_records(writes);
+    }
+    reacquire_caller_mutex(caller_mutex);
+    return ok;
+}
+
+
+void discard_write_group(struct write_group *group)
+{
+    struct staged_writes *writes;
+    WITH_MUTEX(group->mutex)
+    {
+        writes = take_staged_writes(group);
+        take_committed_values(writes);
+    }
+    restore_staged_records(writes);
+}
+
+
 /* Common out record processing.  If writing fails then restore saved value,
  * otherwise maintain saved and persistent settings. */
 static bool process_out_record(
@@ -952,11 +1589,18 @@ static bool process_out_record(
     if (base == NULL)
         return false;
 
+    /* Staged writes are deferred until the group is committed. */
+    if (base->out.group  &&  !base->disable_write)
+    {
+        stage_write(base, result, value_size);
+        return true;
+    }
+
     bool write_ok = base->disable_write;
     if (!base->disable_write)
     {
         if (base->mutex)  pthread_mutex_lock(base->mutex);
-        PUSH_CURRENT_RECORD(base);
+        PUSH_CURRENT_RECORD(base, base->mutex);
         write_ok = base->out.write(base->context, result);
         POP_CURRENT_RECORD();
         if (base->mutex)  pthread_mutex_unlock(base->mutex);
@@ -967,8 +1611,8 @@ static bool process_out_record(
         /* On successful update take a record (in case we have to revert) and
          * update the persistent record. */
         memcpy(base->out.save_value, result, value_size);
-        if (base->persist)
-            write_persistent_variable(base->key, result);
+        if (base->persistence)
+            write_persistent_variable(base->persistence, result);
         return true;
     }
     else
@@ -1092,8 +1736,8 @@ static long init_record_waveform(waveformRecord *pr)
     struct epics_record *base = pr->dpvt;
     unsigned int nord = 0;
     bool read_ok =
-        base->persist  &&
-        read_persistent_waveform(base->key, pr->bptr, &nord);
+        base->persistence  &&
+        read_persistent_waveform(base->persistence, pr->bptr, &nord);
     if (!read_ok  &&  base->waveform.init)
     {
         nord = pr->nelm;
@@ -1118,15 +1762,15 @@ static long process_waveform(waveformRecord *pr)
     {
         unsigned int nord = pr->nord;
         if (base->mutex)  pthread_mutex_lock(base->mutex);
-        PUSH_CURRENT_RECORD(base);
+        PUSH_CURRENT_RECORD(base, base->mutex);
         base->waveform.process(base->context, pr->bptr, &nord);
         POP_CURRENT_RECORD();
         if (base->mutex)  pthread_mutex_unlock(base->mutex);
         pr->nord = nord;
     }
 
-    if (base->persist)
-        write_persistent_waveform(base->key, pr->bptr, pr->nord);
+    if (base->persistence)
+        write_persistent_waveform(base->persistence, pr->bptr, pr->nord);
 
     recGblSetSevr(pr, READ_ALARM, base->severity);
 
@@ -1176,11 +1820,10 @@ DEFINE_DEVICE(waveform,  5, process_waveform);
 
 void dump_epics_device_db(FILE *output)
 {
-    const void *key;
-    void *value;
-    for (int ix = 0; hash_table_walk(hash_table, &ix, &key, &value);)
+    struct record_table_cursor cursor = record_table_walk_start(record_table);
+    struct epics_record *base;
+    while (record_table_walk(&cursor, NULL, &base))
     {
-        const struct epics_record *base = value;
         fprintf(output, "\t%s\n", base->key);
     }
 }
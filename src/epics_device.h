@@ -7,18 +7,22 @@
  *  IN records
  *  ----------
  *      Record types: [u]longin, ai, bi, stringin, mbbi
- *      PUBLISH(record, name, read, .context, .io_intr, .set_time, .mutex)
+ *      PUBLISH(record, name, read,
+ *          .context, .io_intr, .set_time, .lazy, .mutex)
  *      PUBLISH_READ_VAR[_I](record, name, variable)
  *      PUBLISH_READER[_I](record, name, reader)
  *      PUBLISH_TRIGGER[_T](name)
+ *      PUBLISH_STRUCT_READER(type, fields, read, .context, .mutex)
  *
  *  OUT records
  *  -----------
  *      Record types: [u]longout, ao, bo, stringout, mbbo
- *      PUBLISH(record, name, write, .init, .context, .persist, .mutex)
+ *      PUBLISH(record, name, write,
+ *          .init, .context, .persist, .group, .mutex)
  *      PUBLISH_WRITE_VAR[_P](record, name, variable)
  *      PUBLISH_WRITER[_B][_P](record, name, writer)
  *      PUBLISH_ACTION(name, action)
+ *      PUBLISH_COMMIT(name, group)
  *
  *  WAVEFORM records
  *  ----------------
@@ -46,8 +50,10 @@
  *
  * The following two macros define the core interface.
  *
- *  PUBLISH(in_record, name, read, .context, .io_intr, .set_time, .mutex)
- *  PUBLISH(out_record, name, write, .init, .context, .persist, .mutex)
+ *  PUBLISH(in_record, name, read,
+ *      .context, .io_intr, .set_time, .lazy, .mutex)
+ *  PUBLISH(out_record, name, write,
+ *      .init, .context, .persist, .group, .mutex)
  *
  *      The PUBLISH macro is used to create a software binding for the
  *      appropriate record type to the given name.  The corresponding read or
@@ -118,10 +124,24 @@
  *          This is most conveniently combined with io_intr.  The _T macro
  *          variant automatically sets this flag.
  *
+ *      bool lazy
+ *          For IN records this flag can be set to skip calling read when
+ *          nothing can see the result: the record has no monitors, no forward
+ *          link, and (from EPICS 3.16) no other record links to it.  Useful
+ *          for expensive readers whose values are only consumed by monitors.
+ *
  *      bool persist
  *          For OUT and WAVEFORM records this flag can be set to ensure that all
  *          successful writes are mirrored to persistent storage, and the record
- *          will be initialised from persistent storage if possible.
+ *          will be initialised from persistent storage if possible.  For IN
+ *          records each value read is saved, and the record starts with the
+ *          last saved value marked with a minor READ alarm as stale until a
+ *          value is successfully read.
+ *
+ *      struct write_group *group
+ *          For OUT records this can be set to stage writes: processing the
+ *          record only buffers the new value, and write is called later when
+ *          the group is committed, see commit_write_group() below.
  *
  *
  * The following macros provide specialisation for specific types of record.
@@ -252,10 +272,21 @@ struct timespec;
 /* This must be called once before publishing any PVs. */
 error__t initialise_epics_device(void);
 
+/* Equivalent to initialise_epics_device(), but also sizes the record table for
+ * record_count records and the table of persistent variables for
+ * persistent_count variables, so that these tables are not repeatedly rebuilt
+ * while a large number of PVs are published.  Can also be called again. */
+error__t initialise_epics_device_capacity(
+    unsigned int record_count, unsigned int persistent_count);
+
 /* This can be called after iocInit() to check how many published record
  * bindings are not bound to active records. */
 unsigned int check_unused_record_bindings(bool verbose);
 
+/* Prints a summary of the number of reads skipped by records published with
+ * .lazy set, together with a report for each lazy record if verbose is set. */
+void report_lazy_reads(bool verbose);
+
 /* This sets the default mutex associated with each published record, and
  * returns the previously set default.  The default mutex is used if the .mutex
  * argument is not assigned. */
@@ -372,6 +403,10 @@ struct epics_record *lookup_epics_record(
 #define LOOKUP_RECORD(record, name) \
     lookup_epics_record(RECORD_TYPE_##record, name)
 
+/* Reads the value saved in persistent storage for a record published with
+ * .persist set, returns false if no value has been saved. */
+bool read_record_persistence(struct epics_record *record, void *value);
+
 /* During record processing this function can be called to retrieve the
  * underlying epics_record being processed.  At any other time NULL will be
  * returned. */
@@ -495,6 +530,97 @@ void _read_record_waveform(
         set_default_epics_device_mutex(old_mutex))
 
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Struct readers.
+ *
+ *  PUBLISH_STRUCT_READER(type, fields, read, .context, .mutex)
+ *
+ *      Binds a structure of the given type to a set of IN records described by
+ *      the layout table fields[], an array of STRUCT_FIELD() entries.  All of
+ *      these records share one I/O Intr scan, so their database records must
+ *      have SCAN set to "I/O Intr".  Each call to trigger_struct_reader()
+ *      processes every record together, and read is called just once to fill
+ *      the entire structure.  If read returns false every record is invalid.
+ *
+ *      bool read(void *context, type *value)
+ *
+ *  STRUCT_FIELD(record, name, type, field)
+ *
+ *      Describes one entry in the layout table: the named record of the given
+ *      record type reads field from type, which must be of type
+ *      TYPEOF(record). */
+
+struct struct_field {
+    enum record_type record_type;
+    const char *name;
+    size_t offset;
+};
+
+#define STRUCT_FIELD(record, name, type, field) \
+    { RECORD_TYPE_##record, name, offsetof(type, field) + \
+        0 * sizeof(struct { int : -!__builtin_types_compatible_p( \
+            typeof(((type *) 0)->field), TYPEOF(record)); }) }
+
+struct struct_reader_args {
+    bool (*read)(void *context, void *value);
+    void *context;
+    pthread_mutex_t *mutex;
+};
+
+struct epics_struct_reader;
+struct epics_struct_reader *_publish_struct_reader(
+    size_t size, const struct struct_field fields[], unsigned int count,
+    const struct struct_reader_args *args);
+#define PUBLISH_STRUCT_READER(type, fields, reader, args...) \
+    _publish_struct_reader(sizeof(type), fields, ARRAY_SIZE(fields), \
+        &(const struct struct_reader_args) { \
+            .read = CAST_FROM_TO(typeof(bool (*)(void *, type *)), \
+                typeof(bool (*)(void *, void *)), reader), ##args })
+
+/* Calls the reader and processes all records bound to the struct reader. */
+void trigger_struct_reader(struct epics_struct_reader *reader);
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Write groups.
+ *
+ * OUT records published with .group set don't call write when processed,
+ * instead the new value is staged in the group.  When the group is committed
+ * write is called for each staged record in the order staged, followed by a
+ * single call to the group commit method which can then apply the combined
+ * values in one operation.  If any write or the final commit fails then the
+ * whole group is rolled back: write is called again with the previously
+ * committed value for every record already written, and every staged record is
+ * restored to its previous value.
+ *
+ *  PUBLISH_COMMIT(name, group)
+ *
+ *      Publishes a bo record which commits the group when processed, failing
+ *      if the commit fails.
+ *
+ * Note that commit_write_group() calls write with the record mutex held, and
+ * must not be called while holding the EPICS lock on any staged record.  No two
+ * record mutexes are ever held together, so when called from record processing
+ * the calling record's mutex is released while the staged values are written.
+ * The group has its own mutex, which is never held while taking a record mutex,
+ * and which is held while calling the commit method, so the commit method must
+ * not take any record mutex.  When a commit from record processing fails the
+ * staged records are restored after processing completes, from an EPICS
+ * callback thread, and any record which cannot be restored is reported. */
+
+struct write_group;
+
+/* Creates a write group.  The commit method is optional. */
+struct write_group *create_write_group(
+    bool (*commit)(void *context), void *context);
+
+/* Writes all staged values, returns false and rolls back all staged writes if
+ * any write or the commit method fails. */
+bool commit_write_group(struct write_group *group);
+
+/* Discards all staged values, restoring all staged records to their last
+ * committed value. */
+void discard_write_group(struct write_group *group);
+
 /******************************************************************************/
 /* Detailed macro based definitions.
  *
@@ -516,6 +642,8 @@ void _read_record_waveform(
         void *context; \
         bool io_intr; \
         bool set_time; \
+        bool lazy; \
+        bool persist; \
         pthread_mutex_t *mutex; \
     }
 #define _DECLARE_IN_ARGS(record) \
@@ -527,6 +655,7 @@ void _read_record_waveform(
         bool (*init)(void *context, type *value); \
         void *context; \
         bool persist; \
+        struct write_group *group; \
         pthread_mutex_t *mutex; \
     }
 #define _DECLARE_OUT_ARGS(record) \
@@ -633,6 +762,10 @@ _DECLARE_WAVEFORM_ARGS(EPICS_STRING);
     PUBLISH(bo, name, .write = _publish_action_bo, \
         .context = *(void (*[])(void)) { action }, ##args)
 
+#define PUBLISH_COMMIT(name, group, args...) \
+    PUBLISH(bo, name, .write = _publish_commit_bo, \
+        .context = ENSURE_TYPE(struct write_group *, group), ##args)
+
 
 #define PROC_WAVEFORM_T(type) \
     void (*)(void *context, type *array, unsigned int *length)
@@ -718,6 +851,7 @@ _FOR_OUT_RECORDS(_DECLARE_WRITER_B, ;)
 
 bool _publish_trigger_bi(void *context, bool *value);
 bool _publish_action_bo(void *context, bool *value);
+bool _publish_commit_bo(void *context, bool *value);
 
 void _publish_waveform_action(void *context, void *array, unsigned int *length);
 void _publish_waveform_write_var(
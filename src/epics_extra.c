@@ -8,12 +8,18 @@
 #include <errno.h>
 #include <pthread.h>
 #include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 
 #include <initHooks.h>
 #include <dbAccess.h>
 
 #include "error.h"
 #include "epics_device.h"
+#include "persistence.h"
 
 #include "epics_extra_internal.h"
 #include "epics_extra.h"
@@ -185,6 +191,7 @@ struct in_epics_record_ {
     size_t field_size;
     bool merge_update;
     bool io_intr;
+    bool restore;               // Value to be restored from persistent storage
     char value[] __attribute__((aligned(__BIGGEST_ALIGNMENT__)));
 };
 
@@ -204,9 +211,19 @@ static size_t record_field_size(enum record_type record_type)
     }
 }
 
+/* Persistent state is only loaded after the record is published, so a
+ * persistent record picks up its saved value on first reading, unless it has
+ * already been written.  The restored value is stale, so is given a minor
+ * alarm, which is replaced by the severity of the first write. */
 static bool read_in_record(void *context, void *value)
 {
     struct in_epics_record_ *record = context;
+    if (record->restore)
+    {
+        if (read_record_persistence(record->record, record->value))
+            set_record_severity(record->record, epics_sev_minor);
+        record->restore = false;
+    }
     memcpy(value, record->value, record->field_size);
     return true;
 }
@@ -223,9 +240,11 @@ struct in_epics_record_ *_publish_write_epics_record(
     record->record = publish_epics_record(
         record_type, name, &(const struct record_args_void) {
             .read = read_in_record, .context = record,
-            .io_intr = args->io_intr, .set_time = args->set_time });
+            .io_intr = args->io_intr, .set_time = args->set_time,
+            .persist = args->persist });
     record->merge_update = args->merge_update;
     record->io_intr = args->io_intr;
+    record->restore = args->persist;
     memset(record->value, 0, record->field_size);
     return record;
 }
@@ -250,7 +269,10 @@ void _write_in_record(
     {
         set_record_severity(record->record, args->severity);
         if (value)
+        {
             memcpy(record->value, value, record->field_size);
+            record->restore = false;
+        }
         if (args->timestamp)
             set_record_timestamp(record->record, args->timestamp);
         if (record->io_intr)
@@ -267,6 +289,198 @@ void *_read_in_record(
 }
 
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Shared read caches. */
+
+struct read_cache {
+    struct read_cache *next;        // List of all caches for reporting
+    const char *name;
+    size_t size;
+    double ttl;                     // Time to live in seconds, or 0
+    bool (*fetch)(void *context, void *block);
+    void *context;
+
+    pthread_mutex_t mutex;
+    bool fetched;                   // Set once the block has been fetched
+    bool valid;                     // Set if the last fetch succeeded
+    unsigned int generation;        // Advanced by read_cache_invalidate()
+    unsigned int fetched_generation;    // Generation of cached block
+    struct timespec expiry;         // Time when ttl runs out
+
+    /* Statistics for reporting. */
+    uint64_t hits;
+    uint64_t fetches;
+    uint64_t failures;
+
+    char block[] __attribute__((aligned(__BIGGEST_ALIGNMENT__)));
+};
+
+static struct read_cache *read_caches = NULL;
+static pthread_mutex_t read_caches_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+struct read_cache *create_read_cache(
+    const char *name, size_t size, double ttl,
+    bool (*fetch)(void *context, void *block), void *context)
+{
+    struct read_cache *cache = malloc(sizeof(struct read_cache) + size);
+    *cache = (struct read_cache) {
+        .name = strdup(name),
+        .size = size,
+        .ttl = ttl,
+        .fetch = fetch,
+        .context = context,
+    };
+    ASSERT_PTHREAD(pthread_mutex_init(&cache->mutex, NULL));
+    memset(cache->block, 0, size);
+
+    WITH_MUTEX(read_caches_mutex)
+    {
+        cache->next = read_caches;
+        read_caches = cache;
+    }
+    return cache;
+}
+
+
+void read_cache_invalidate(struct read_cache *cache)
+{
+    WITH_MUTEX(cache->mutex)
+        cache->generation += 1;
+}
+
+
+static bool timespec_before(
+    const struct timespec *now, const struct timespec *limit)
+{
+    return
+        now->tv_sec < limit->tv_sec  ||
+        (now->tv_sec == limit->tv_sec  &&  now->tv_nsec < limit->tv_nsec);
+}
+
+
+static struct timespec timespec_add_seconds(
+    struct timespec time, double seconds)
+{
+    time_t whole_seconds = (time_t) seconds;
+    time.tv_sec += whole_seconds;
+    time.tv_nsec += (long) (1e9 * (seconds - (double) whole_seconds));
+    if (time.tv_nsec >= 1000000000)
+    {
+        time.tv_nsec -= 1000000000;
+        time.tv_sec += 1;
+    }
+    return time;
+}
+
+
+/* Checks whether the result of the last fetch can be used.  Must be called with
+ * the cache lock held.  A zero ttl means that the block is always fetched, a
+ * negative ttl that it only expires when invalidated.  A failed fetch expires
+ * in the same way, so a block that cannot be read is not fetched again by
+ * every other read in the same cycle. */
+static bool cache_current(struct read_cache *cache, const struct timespec *now)
+{
+    return
+        cache->fetched  &&  cache->ttl != 0  &&
+        cache->fetched_generation == cache->generation  &&
+        (cache->ttl < 0  ||  timespec_before(now, &cache->expiry));
+}
+
+
+/* Refills the cache and computes the new expiry time. */
+static void fetch_cache(struct read_cache *cache, const struct timespec *now)
+{
+    cache->fetches += 1;
+    cache->fetched = true;
+    cache->valid = cache->fetch(cache->context, cache->block);
+    cache->fetched_generation = cache->generation;
+    if (cache->ttl > 0)
+        cache->expiry = timespec_add_seconds(*now, cache->ttl);
+    if (!cache->valid)
+        cache->failures += 1;
+}
+
+
+bool read_cache_read(
+    struct read_cache *cache, size_t offset, size_t size, void *result)
+{
+    ASSERT_OK(offset + size <= cache->size);
+
+    struct timespec now;
+    ASSERT_IO(clock_gettime(CLOCK_MONOTONIC, &now));
+    bool ok;
+    WITH_MUTEX(cache->mutex)
+    {
+        if (cache_current(cache, &now))
+            cache->hits += 1;
+        else
+            fetch_cache(cache, &now);
+        ok = cache->valid;
+        if (ok)
+            memcpy(result, cache->block + offset, size);
+    }
+    return ok;
+}
+
+
+void report_read_caches(void)
+{
+    WITH_MUTEX(read_caches_mutex)
+    {
+        for (struct read_cache *cache = read_caches; cache;
+             cache = cache->next)
+        {
+            uint64_t hits, fetches, failures;
+            WITH_MUTEX(cache->mutex)
+            {
+                hits = cache->hits;
+                fetches = cache->fetches;
+                failures = cache->failures;
+            }
+            uint64_t reads = hits + fetches;
+            printf("%s: %"PRIu64" reads, %"PRIu64" fetches "
+                "(%"PRIu64" failed), hit rate %.1f%%\n",
+                cache->name, reads, fetches, failures,
+                reads > 0 ? 100.0 * (double) hits / (double) reads : 0.0);
+        }
+    }
+}
+
+
+/* Each cached record needs to know which part of the block it reads. */
+struct cached_field {
+    struct read_cache *cache;
+    size_t offset;
+    size_t size;
+};
+
+static bool read_cached_field(void *context, void *value)
+{
+    struct cached_field *field = context;
+    return read_cache_read(field->cache, field->offset, field->size, value);
+}
+
+struct epics_record *_publish_cached_field(
+    enum record_type record_type, const char *name, struct read_cache *cache,
+    size_t offset, size_t size, const struct publish_cached_args *args)
+{
+    ASSERT_OK(size == record_field_size(record_type));
+
+    struct cached_field *field = malloc(sizeof(struct cached_field));
+    *field = (struct cached_field) {
+        .cache = cache,
+        .offset = offset,
+        .size = size,
+    };
+    return publish_epics_record(
+        record_type, name, &(const struct record_args_void) {
+            .read = read_cached_field, .context = field,
+            .io_intr = args->io_intr, .set_time = args->set_time,
+            .lazy = args->lazy });
+}
+
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* IOC startup support. */
 
@@ -328,6 +542,276 @@ error__t database_load_file(const char *filename)
 }
 
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Memory mapped register blocks. */
+
+/* The register block is compared 16 bytes at a time using the compiler's
+ * generic vector extension, which compiles to SSE2 or NEON as appropriate. */
+typedef uint32_t register_vector_t
+    __attribute__((vector_size(16), may_alias));
+#define VECTOR_WORDS    ((unsigned int) (sizeof(register_vector_t) / 4))
+/* We compare four vectors at a time so that unchanged blocks are skipped with
+ * as few tests as possible. */
+#define BLOCK_VECTORS   4
+#define BLOCK_WORDS     (BLOCK_VECTORS * VECTOR_WORDS)
+
+
+/* Each published register needs its own context so that the shared read
+ * method can find its value. */
+struct register_record {
+    struct register_block *block;
+    unsigned int index;
+    struct epics_record *record;    // NULL if this register is not published
+};
+
+struct register_block {
+    const volatile uint32_t *base;  // Hardware registers
+    unsigned int count;             // Number of registers
+    unsigned int vectors;           // Count rounded up to whole blocks
+    bool first_scan;                // Forces trigger of every record
+    /* The snapshot is what the records read, and the staging area is filled
+     * from the hardware on each scan.  Both are padded to whole blocks. */
+    register_vector_t *snapshot;
+    register_vector_t *staging;
+    /* Changed records collected during a scan. */
+    struct epics_record **changed;
+    pthread_mutex_t mutex;          // Guards snapshot against scan swap
+    struct register_record records[];
+};
+
+
+/* This is called with block->mutex held by the record processing. */
+static bool read_register(void *context, uint32_t *value)
+{
+    struct register_record *reg = context;
+    const uint32_t *snapshot = (const uint32_t *) reg->block->snapshot;
+    *value = snapshot[reg->index];
+    return true;
+}
+
+
+static register_vector_t *allocate_vectors(unsigned int vectors)
+{
+    register_vector_t *result;
+    ASSERT_PTHREAD(posix_memalign(
+        (void **) &result, sizeof(register_vector_t),
+        vectors * sizeof(register_vector_t)));
+    memset(result, 0, vectors * sizeof(register_vector_t));
+    return result;
+}
+
+
+struct register_block *publish_register_block(
+    const volatile uint32_t *base, unsigned int count,
+    const char *const names[])
+{
+    struct register_block *block = malloc(
+        sizeof(struct register_block) +
+        count * sizeof(struct register_record));
+    unsigned int blocks = (count + BLOCK_WORDS - 1) / BLOCK_WORDS;
+    block->base = base;
+    block->count = count;
+    block->vectors = blocks * BLOCK_VECTORS;
+    block->first_scan = true;
+    block->snapshot = allocate_vectors(block->vectors);
+    block->staging = allocate_vectors(block->vectors);
+    block->changed = calloc(count, sizeof(struct epics_record *));
+    ASSERT_PTHREAD(pthread_mutex_init(&block->mutex, NULL));
+
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        struct register_record *reg = &block->records[i];
+        reg->block = block;
+        reg->index = i;
+        reg->record = NULL;
+
+        const char *name = names ? names[i] : NULL;
+        char index_name[16];
+        if (names == NULL)
+        {
+            sprintf(index_name, "%u", i);
+            name = index_name;
+        }
+        if (name)
+            reg->record = PUBLISH(ulongin, name,
+                .read = read_register, .context = reg,
+                .io_intr = true, .mutex = &block->mutex);
+    }
+    return block;
+}
+
+
+error__t map_register_block(
+    const char *file_name, size_t offset, unsigned int count,
+    const char *const names[], struct register_block **block)
+{
+    /* mmap requires a page aligned offset, so we map from the start of the
+     * containing page and adjust the base accordingly. */
+    size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    size_t page_offset = offset % page_size;
+    size_t map_length = page_offset + count * sizeof(uint32_t);
+
+    int file;
+    void *map;
+    return
+        TEST_IO_(file = open(file_name, O_RDONLY | O_SYNC),
+            "Unable to open register block %s", file_name)  ?:
+        DO_FINALLY(
+            TEST_OK_IO_((map = mmap(
+                NULL, map_length, PROT_READ, MAP_SHARED,
+                file, (off_t) (offset - page_offset))) != MAP_FAILED,
+                "Unable to map register block %s", file_name),
+            close(file))  ?:
+        DO(*block = publish_register_block(
+            map + page_offset, count, names));
+}
+
+
+static bool vector_is_zero(register_vector_t vector)
+{
+    uint64_t words[sizeof(register_vector_t) / sizeof(uint64_t)];
+    memcpy(words, &vector, sizeof(words));
+    uint64_t result = 0;
+    for (unsigned int i = 0; i < ARRAY_SIZE(words); i ++)
+        result |= words[i];
+    return result == 0;
+}
+
+
+/* Compares the staging area with the snapshot and records every changed and
+ * published record, returning the number of changed records.  *differs is set
+ * if any register has changed, even if it is not published. */
+static unsigned int find_changed_registers(
+    struct register_block *block, bool *differs)
+{
+    const register_vector_t *staging = block->staging;
+    const register_vector_t *snapshot = block->snapshot;
+    unsigned int changed = 0;
+    *differs = false;
+    for (unsigned int v = 0; v < block->vectors; v += BLOCK_VECTORS)
+    {
+        register_vector_t difference = staging[v] ^ snapshot[v];
+        for (unsigned int i = 1; i < BLOCK_VECTORS; i ++)
+            difference |= staging[v + i] ^ snapshot[v + i];
+
+        if (!vector_is_zero(difference)  ||  block->first_scan)
+        {
+            /* Something in this block has changed, so now check each word. */
+            *differs = true;
+            const uint32_t *new_words = (const uint32_t *) &staging[v];
+            const uint32_t *old_words = (const uint32_t *) &snapshot[v];
+            unsigned int base_ix = v * VECTOR_WORDS;
+            unsigned int words = MIN(BLOCK_WORDS, block->count - base_ix);
+            for (unsigned int i = 0; i < words; i ++)
+            {
+                struct epics_record *record =
+                    block->records[base_ix + i].record;
+                if (record  &&
+                    (new_words[i] != old_words[i]  ||  block->first_scan))
+                    block->changed[changed++] = record;
+            }
+        }
+    }
+    return changed;
+}
+
+
+unsigned int scan_register_block(struct register_block *block)
+{
+    /* Read the hardware with one 32-bit access per register: some register
+     * interfaces will not tolerate wider accesses. */
+    uint32_t *staging = (uint32_t *) block->staging;
+    for (unsigned int i = 0; i < block->count; i ++)
+        staging[i] = block->base[i];
+
+    /* Only this function writes to the snapshot, so we can compare without
+     * holding the lock, which is only needed to swap the buffers. */
+    bool differs;
+    unsigned int changed = find_changed_registers(block, &differs);
+    block->first_scan = false;
+    if (differs)
+        WITH_MUTEX(block->mutex)
+        {
+            register_vector_t *snapshot = block->snapshot;
+            block->snapshot = block->staging;
+            block->staging = snapshot;
+        }
+
+    for (unsigned int i = 0; i < changed; i ++)
+        trigger_record(block->changed[i]);
+    return changed;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Persistence statistics. */
+
+/* The persistence statistics converted to the types of the published records,
+ * so that they can be served from a read cache. */
+struct persistence_stats_pvs {
+    int32_t variable_count;
+    double variable_bytes;
+    int32_t dirty_count;
+    int32_t save_count;
+    double last_save_time;
+    double last_save_bytes;
+    double bytes_written;
+    double load_time;
+    int32_t lock_waits;
+    double lock_wait_time;
+    double max_lock_wait;
+    double flush_latency;
+};
+
+
+static bool fetch_persistence_stats(void *context, void *block)
+{
+    struct persistence_stats stats;
+    get_persistence_stats(&stats);
+    struct persistence_stats_pvs *pvs = block;
+    *pvs = (struct persistence_stats_pvs) {
+        .variable_count = (int32_t) stats.variable_count,
+        .variable_bytes = (double) stats.variable_bytes,
+        .dirty_count = (int32_t) stats.dirty_count,
+        .save_count = (int32_t) stats.save_count,
+        .last_save_time = stats.last_save_time,
+        .last_save_bytes = (double) stats.last_save_bytes,
+        .bytes_written = (double) stats.bytes_written,
+        .load_time = stats.load_time,
+        .lock_waits = (int32_t) stats.lock_waits,
+        .lock_wait_time = stats.lock_wait_time,
+        .max_lock_wait = stats.max_lock_wait,
+        .flush_latency = stats.flush_latency,
+    };
+    return true;
+}
+
+
+void publish_persistence_stats(void)
+{
+    /* All the records are normally scanned together, so one fetch of the
+     * statistics serves them all. */
+    struct read_cache *cache = create_read_cache(
+        "PERSISTENCE", sizeof(struct persistence_stats_pvs), 0.1,
+        fetch_persistence_stats, NULL);
+#define PUBLISH_STATS(record, name, field) \
+    PUBLISH_CACHED(record, name, cache, struct persistence_stats_pvs, field)
+    PUBLISH_STATS(longin, "VARIABLES",  variable_count);
+    PUBLISH_STATS(ai,     "BYTES",      variable_bytes);
+    PUBLISH_STATS(longin, "DIRTY",      dirty_count);
+    PUBLISH_STATS(longin, "SAVES",      save_count);
+    PUBLISH_STATS(ai,     "SAVE_TIME",  last_save_time);
+    PUBLISH_STATS(ai,     "SAVE_BYTES", last_save_bytes);
+    PUBLISH_STATS(ai,     "WRITTEN",    bytes_written);
+    PUBLISH_STATS(ai,     "LOAD_TIME",  load_time);
+    PUBLISH_STATS(longin, "WAITS",      lock_waits);
+    PUBLISH_STATS(ai,     "WAIT_TIME",  lock_wait_time);
+    PUBLISH_STATS(ai,     "WAIT_MAX",   max_lock_wait);
+    PUBLISH_STATS(ai,     "FLUSH_TIME", flush_latency);
+#undef PUBLISH_STATS
+}
+
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 void initialise_epics_extra(void)
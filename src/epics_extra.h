@@ -81,8 +81,10 @@ error__t database_load_file(const char *filename);
  *
  * The API here consists of the following calls:
  *
- *  record = PUBLISH_IN_VALUE[_I](type, name, .set_time, .merge_update)
+ *  record = PUBLISH_IN_VALUE[_I](
+ *      type, name, .set_time, .merge_update, .persist)
  *      Publishes EPICS PV with writeable value stored as part of the record.
+ *      If .persist is set the stored value starts with the last saved value.
  *
  *  WRITE_IN_RECORD(type, record, value, .severity, .timestamp, .force_update)
  *      Updates record with new value.  Optionally a .severity and a .timestamp
@@ -117,6 +119,7 @@ struct publish_in_epics_record_args {
     bool io_intr;
     bool set_time;
     bool merge_update;
+    bool persist;
 };
 struct in_epics_record_ *_publish_write_epics_record(
     enum record_type record_type, const char *name,
@@ -156,3 +159,101 @@ void *_read_in_record(
 #define READ_IN_RECORD(type, record) \
     (* (const TYPEOF(type) *) _read_in_record( \
         RECORD_TYPE_##type, _CONVERT_TO_IN_RECORD(type, record))
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Shared read caches.
+ *
+ * A read cache holds a copy of a block of data, typically a hardware status
+ * block, which is read by many records.  The first read after the cache has
+ * expired fetches the whole block, every other read uses the cached copy.  The
+ * cache expires either after a fixed time to live, or when its generation is
+ * advanced by calling read_cache_invalidate(), or both. */
+
+struct read_cache;
+
+/* Creates a read cache holding size bytes.  fetch() is called to refill the
+ * cache and should return false if the block cannot be read.  If ttl is
+ * positive then the cache expires ttl seconds after each fetch, if ttl is
+ * READ_CACHE_NO_EXPIRY the cache only expires when invalidated, and if ttl is
+ * zero every read fetches the block.  A failed fetch expires in the same way.
+ * The name is only used for reporting. */
+#define READ_CACHE_NO_EXPIRY    (-1.0)
+struct read_cache *create_read_cache(
+    const char *name, size_t size, double ttl,
+    bool (*fetch)(void *context, void *block), void *context);
+
+/* Advances the cache generation, forcing a fetch on the next read.  For example
+ * this can be called at the start of each processing cycle. */
+void read_cache_invalidate(struct read_cache *cache);
+
+/* Copies size bytes at offset from the cached block into result, fetching the
+ * block first if necessary.  Returns false if the last fetch failed. */
+bool read_cache_read(
+    struct read_cache *cache, size_t offset, size_t size, void *result);
+
+/* Prints the hit rate of every read cache. */
+void report_read_caches(void);
+
+
+/* PUBLISH_CACHED(record, name, cache, type, field, .io_intr, .set_time, .lazy)
+ *
+ * Publishes an IN record which reads the given field of the structure type held
+ * in cache.  The field must have type TYPEOF(record). */
+struct publish_cached_args {
+    bool io_intr;
+    bool set_time;
+    bool lazy;
+};
+struct epics_record *_publish_cached_field(
+    enum record_type record_type, const char *name, struct read_cache *cache,
+    size_t offset, size_t size, const struct publish_cached_args *args);
+#define PUBLISH_CACHED(record, name, cache, type, field, args...) \
+    ( { \
+        COMPILE_ASSERT(__builtin_types_compatible_p( \
+            typeof(((type *) 0)->field), TYPEOF(record))); \
+        _publish_cached_field(RECORD_TYPE_##record, name, cache, \
+            offsetof(type, field), sizeof(TYPEOF(record)), \
+            &(const struct publish_cached_args) { args }); \
+    } )
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Memory mapped register blocks.
+ *
+ * A register block publishes a block of 32-bit registers, typically mapped from
+ * a UIO device, as a set of I/O Intr ulongin records.  Instead of polling each
+ * register separately the driver calls scan_register_block() which compares
+ * the entire block against the previous snapshot and only triggers the records
+ * whose registers have changed. */
+
+struct register_block;
+
+/* Publishes count registers starting at base.  If names is NULL then each
+ * record is named by its register index, otherwise names[i] is used to name
+ * register i, and registers with a NULL name are not published.  The register
+ * block must remain mapped for the lifetime of the IOC. */
+struct register_block *publish_register_block(
+    const volatile uint32_t *base, unsigned int count,
+    const char *const names[]);
+
+/* Maps count registers at the given byte offset into file_name, which can be a
+ * UIO device or an ordinary file, and publishes them as for
+ * publish_register_block().  The offset need not be page aligned. */
+error__t map_register_block(
+    const char *file_name, size_t offset, unsigned int count,
+    const char *const names[], struct register_block **block);
+
+/* Reads the entire register block, compares it with the last snapshot, and
+ * triggers each record whose register has changed.  Every published record is
+ * triggered on the first scan.  Returns the number of records triggered. */
+unsigned int scan_register_block(struct register_block *block);
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Persistence statistics.
+ *
+ * Publishes the statistics returned by get_persistence_stats() as a set of IN
+ * records, normally within a name prefix: longin records VARIABLES, DIRTY,
+ * SAVES and WAITS, and ai records BYTES, SAVE_TIME, SAVE_BYTES, WRITTEN,
+ * LOAD_TIME, WAIT_TIME, WAIT_MAX and FLUSH_TIME, with all times in seconds. */
+void publish_persistence_stats(void);
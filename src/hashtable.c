@@ -10,10 +10,17 @@
 #include "error.h"
 
 #include "hashtable.h"
+#include "hashtable_typed.h"
 
 
-#define EMPTY_HASH      0               // Marks unused slot
-#define DELETED_HASH    ((hash_t) -1)   // Marks deleted slot, "tombstone"
+/* Two table layouts are supported, selected at compile time.  By default a
+ * "Swiss table" layout is used where a separate array of one byte control tags
+ * is searched a group of slots at a time, using SSE2 or NEON where available.
+ * Setting HASH_TABLE_SWISS to 0 selects the original layout where every probe
+ * examines a complete table entry. */
+#ifndef HASH_TABLE_SWISS
+#define HASH_TABLE_SWISS    1
+#endif
 
 
 struct table_entry {
@@ -24,47 +31,43 @@ struct table_entry {
 
 struct hash_table {
     const struct hash_table_ops *key_ops;   // Key operations
+    bool mixed_hash;    // Set if key_ops->hash is known to be well mixed
     size_t entries;     // Number of entries in table
     size_t deleted;     // Number of deleted entries in table
     size_t size_mask;   // True size is power of 2, mask selects modulo size
     struct table_entry *table;
+#if HASH_TABLE_SWISS
+    uint8_t *control;   // One control tag for each entry in table
+#endif
 };
 
 
-#define INITIAL_SIZE    8
+hash_t hash_table_hash_bytes(const void *data, size_t length)
+{
+    return _hash_bytes(data, length);
+}
 
 
-/* Hash algorithm lifted from Python Objects/stringobject.c:string_hash. */
 static hash_t hash_string(const void *key)
 {
-    const char *s = key;
-    size_t length = strlen(s);
-    if (length == 0)
-        return 0;
-    else
-    {
-        hash_t hash = (hash_t) *s++ << 7;
-        for (size_t i = 1; i < length; i++)
-            hash = (1000003 * hash) ^ (hash_t) (unsigned int) *s++;
-        return hash ^ length;
-    }
+    return hash_string_key(key);
 }
 
 
 static bool compare_string(const void *key1, const void *key2)
 {
-    return strcmp(key1, key2) == 0;
+    return compare_string_key(key1, key2);
 }
 
 
-static hash_t hash_ptr(const void *key)
+hash_t hash_table_hash_ptr(const void *key)
 {
-    return (hash_t) (uintptr_t) key;
+    return hash_ptr_key(key);
 }
 
 static bool compare_ptr(const void *key1, const void *key2)
 {
-    return key1 == key2;
+    return compare_ptr_key(key1, key2);
 }
 
 
@@ -84,79 +87,179 @@ static struct hash_table_ops keep_string_ops = {
 
 /* Pointer keys, no lifetime management required. */
 static struct hash_table_ops ptr_ops = {
-    .hash = hash_ptr,
+    .hash = hash_table_hash_ptr,
     .compare = compare_ptr,
 };
 
 
 
-struct hash_table *hash_table_create_generic(const struct hash_table_ops *ops)
-{
-    struct hash_table *table = malloc(sizeof(struct hash_table));
-    *table = (struct hash_table) {
-        .key_ops = ops,
-        .entries = 0,
-        .deleted = 0,
-        .size_mask = INITIAL_SIZE - 1,
-        .table = calloc(INITIAL_SIZE, sizeof(struct table_entry)),
-    };
-    return table;
-}
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Table layout. */
 
+/* Each layout provides the following:
+ *
+ *  allocate_table(table, size)     Allocates empty table of given size
+ *  free_table(table)               Releases table storage
+ *  compute_hash(table, key)        Computes hash as stored in table entries
+ *  lookup(table, key, hash, found) Finds entry containing key or its slot
+ *  occupied(table, ix)             Checks whether entry ix holds a key
+ *  is_deleted(table, entry)        Checks whether an empty entry is deleted
+ *  set_occupied(table, entry, hash)    Marks entry as holding a key
+ *  set_deleted(table, entry)       Removes key, returns true if tombstone left
+ *  over_full(table)                Checks whether table needs to be resized
+ *  probe_length(table, hash, ix)   Number of probe steps from hash to slot ix
+ *  validate_slot(table, ix)        Layout specific checks on slot ix */
 
-struct hash_table *hash_table_create_ptrs(void)
+#if HASH_TABLE_SWISS
+
+/* The group matching primitives and the probe sequence are shared with the
+ * typed hash tables in hashtable_typed.h. */
+
+#define INITIAL_SIZE    _HASH_GROUP_SIZE
+
+
+static void allocate_table(struct hash_table *table, size_t size)
 {
-    return hash_table_create_generic(&ptr_ops);
+    table->size_mask = size - 1;
+    table->table = calloc(size, sizeof(struct table_entry));
+    table->control = _hash_create_control(size);
 }
 
 
-struct hash_table *hash_table_create(bool copy_keys)
+static void free_table(struct hash_table *table)
 {
-    return hash_table_create_generic(
-        copy_keys ? &copy_string_ops : &keep_string_ops);
+    free(table->table);
+    free(table->control);
 }
 
 
-/* Two hash values are reserved for special meanings in hash table entries, this
- * wrapper ensures they're never generated. */
+/* We take the tag from the bottom of the hash and the group from the bits
+ * above, so the hash must be well mixed.  Our own string and pointer hashes
+ * are, but a user supplied hash may be as simple as the identity, so this is
+ * mixed first with the MurmurHash3 finaliser. */
 static hash_t compute_hash(struct hash_table *table, const void *key)
 {
     hash_t hash = table->key_ops->hash(key);
-    if (hash == EMPTY_HASH  ||  hash == DELETED_HASH)
-        hash = (hash_t) -2;
+    if (!table->mixed_hash)
+    {
+        hash ^= hash >> 33;
+        hash *= UINT64_C(0xff51afd7ed558ccd);
+        hash ^= hash >> 33;
+        hash *= UINT64_C(0xc4ceb9fe1a85ec53);
+        hash ^= hash >> 33;
+    }
     return hash;
 }
 
 
-/* Helper for checking whether a table entry is occupied. */
-static bool empty_entry(struct table_entry *entry)
+/* Core lookup process: returns entry containing key or where it can be put,
+ * also sets flag indicating if value was found. */
+static struct table_entry *lookup(
+    struct hash_table *table, const void *key, hash_t hash, bool *found)
 {
-    return entry->hash == EMPTY_HASH  ||  entry->hash == DELETED_HASH;
+    struct table_entry *entries = table->table;
+    return &entries[_HASH_PROBE(table->control, table->size_mask, hash,
+        found, ix,
+        entries[ix].hash == hash  &&
+        table->key_ops->compare(key, entries[ix].key),
+        _hash_match_free)];
 }
 
 
-/* Helper for calling the release_key method.  As we want the underlying key
- * interface to work with const pointers somewhere we need to remove the const
- * pointer on copied keys.  Here is where it's done. */
-static void release_key(struct hash_table *table, const void *key)
+static inline bool occupied(struct hash_table *table, size_t ix)
 {
-    table->key_ops->release_key(CAST_FROM_TO(const void *, void *, key));
+    return _hash_occupied(table->control, ix);
 }
 
 
-void hash_table_destroy(struct hash_table *table)
+static inline bool is_deleted(
+    struct hash_table *table, struct table_entry *entry)
 {
-    if (table->key_ops->release_key)
+    return table->control[entry - table->table] == _HASH_CONTROL_DELETED;
+}
+
+
+static inline void set_occupied(
+    struct hash_table *table, struct table_entry *entry, hash_t hash)
+{
+    entry->hash = hash;
+    table->control[entry - table->table] = _hash_tag(hash);
+}
+
+
+static bool set_deleted(struct hash_table *table, struct table_entry *entry)
+{
+    entry->hash = 0;
+    return _hash_set_deleted(
+        table->control, (size_t) (entry - table->table));
+}
+
+
+static inline bool over_full(struct hash_table *table)
+{
+    return _hash_over_full(table->entries, table->size_mask);
+}
+
+
+/* Here a probe step examines a complete group. */
+static size_t probe_length(struct hash_table *table, hash_t hash, size_t ix)
+{
+    size_t group_mask = table->size_mask / _HASH_GROUP_SIZE;
+    size_t group = (size_t) (hash >> 7) & group_mask;
+    size_t length = 1;
+    for (size_t stride = 1; group != ix / _HASH_GROUP_SIZE;
+         group = (group + stride++) & group_mask)
+        length += 1;
+    return length;
+}
+
+
+/* Control tags must agree with the entries, and unused entries must be zero
+ * as lookup returns their value when a key is absent. */
+static void validate_slot(struct hash_table *table, size_t ix)
+{
+    struct table_entry *entry = &table->table[ix];
+    uint8_t control = table->control[ix];
+    if (occupied(table, ix))
+        ASSERT_OK(control == _hash_tag(entry->hash));
+    else
     {
-        for (size_t i = 0; i <= table->size_mask; i++)
-        {
-            struct table_entry *entry = &table->table[i];
-            if (!empty_entry(entry))
-                release_key(table, entry->key);
-        }
+        ASSERT_OK(
+            control == _HASH_CONTROL_EMPTY  ||
+            control == _HASH_CONTROL_DELETED);
+        ASSERT_OK(entry->key == NULL  &&  entry->value == NULL);
     }
+}
+
+#else
+
+#define EMPTY_HASH      0               // Marks unused slot
+#define DELETED_HASH    ((hash_t) -1)   // Marks deleted slot, "tombstone"
+
+#define INITIAL_SIZE    8
+
+
+static void allocate_table(struct hash_table *table, size_t size)
+{
+    table->size_mask = size - 1;
+    table->table = calloc(size, sizeof(struct table_entry));
+}
+
+
+static void free_table(struct hash_table *table)
+{
     free(table->table);
-    free(table);
+}
+
+
+/* Two hash values are reserved for special meanings in hash table entries, this
+ * wrapper ensures they're never generated. */
+static hash_t compute_hash(struct hash_table *table, const void *key)
+{
+    hash_t hash = table->key_ops->hash(key);
+    if (hash == EMPTY_HASH  ||  hash == DELETED_HASH)
+        hash = (hash_t) -2;
+    return hash;
 }
 
 
@@ -195,6 +298,123 @@ static struct table_entry *lookup(
 }
 
 
+/* Helper for checking whether a table entry is occupied. */
+static inline bool occupied(struct hash_table *table, size_t ix)
+{
+    hash_t hash = table->table[ix].hash;
+    return hash != EMPTY_HASH  &&  hash != DELETED_HASH;
+}
+
+
+static inline bool is_deleted(
+    struct hash_table *table, struct table_entry *entry)
+{
+    return entry->hash == DELETED_HASH;
+}
+
+
+static inline void set_occupied(
+    struct hash_table *table, struct table_entry *entry, hash_t hash)
+{
+    entry->hash = hash;
+}
+
+
+static bool set_deleted(struct hash_table *table, struct table_entry *entry)
+{
+    entry->hash = DELETED_HASH;
+    return true;
+}
+
+
+/* Expand table if more than 2/3 full. */
+static inline bool over_full(struct hash_table *table)
+{
+    return 3 * table->entries >= 2 * table->size_mask;
+}
+
+
+/* Here a probe step examines a single entry. */
+static size_t probe_length(struct hash_table *table, hash_t hash, size_t ix)
+{
+    hash_t perturb = hash;
+    size_t length = 1;
+    for (size_t probe = (size_t) hash; (probe & table->size_mask) != ix;
+         perturb >>= 5, probe = 1 + 5*probe + (size_t) perturb)
+        length += 1;
+    return length;
+}
+
+
+static void validate_slot(struct hash_table *table, size_t ix)
+{
+    struct table_entry *entry = &table->table[ix];
+    if (!occupied(table, ix))
+        ASSERT_OK(entry->key == NULL  &&  entry->value == NULL);
+}
+
+#endif
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Hash table API. */
+
+static struct hash_table *create_table(
+    const struct hash_table_ops *ops, bool mixed_hash)
+{
+    struct hash_table *table = malloc(sizeof(struct hash_table));
+    *table = (struct hash_table) {
+        .key_ops = ops,
+        .mixed_hash = mixed_hash,
+        .entries = 0,
+        .deleted = 0,
+    };
+    allocate_table(table, INITIAL_SIZE);
+    return table;
+}
+
+
+struct hash_table *hash_table_create_generic(const struct hash_table_ops *ops)
+{
+    return create_table(ops, false);
+}
+
+
+struct hash_table *hash_table_create_ptrs(void)
+{
+    return create_table(&ptr_ops, true);
+}
+
+
+struct hash_table *hash_table_create(bool copy_keys)
+{
+    return create_table(
+        copy_keys ? &copy_string_ops : &keep_string_ops, true);
+}
+
+
+/* Helper for calling the release_key method.  As we want the underlying key
+ * interface to work with const pointers somewhere we need to remove the const
+ * pointer on copied keys.  Here is where it's done. */
+static void release_key(struct hash_table *table, const void *key)
+{
+    table->key_ops->release_key(CAST_FROM_TO(const void *, void *, key));
+}
+
+
+void hash_table_destroy(struct hash_table *table)
+{
+    if (table->key_ops->release_key)
+    {
+        for (size_t i = 0; i <= table->size_mask; i++)
+            if (occupied(table, i))
+                release_key(table, table->table[i].key);
+    }
+    free_table(table);
+    free(table);
+}
+
+
 void *hash_table_lookup(struct hash_table *table, const void *key)
 {
     bool found;
@@ -228,26 +448,27 @@ static void resize_table(struct hash_table *table, size_t min_size)
     /* Local instance of new hash table so we can use lookup to insert. */
     struct hash_table new_table = {
         .key_ops = table->key_ops,
-        .size_mask = new_size - 1,
+        .mixed_hash = table->mixed_hash,
         .entries = entries,
         .deleted = 0,
-        .table = calloc(new_size, sizeof(struct table_entry)) };
+    };
+    allocate_table(&new_table, new_size);
     for (size_t ix = 0; ix <= table->size_mask; ix ++)
     {
-        struct table_entry *entry = &table->table[ix];
-        if (!empty_entry(entry))
+        if (occupied(table, ix))
         {
+            struct table_entry *entry = &table->table[ix];
             bool found;
             struct table_entry *new_entry =
                 lookup(&new_table, entry->key, entry->hash, &found);
-            new_entry->hash = entry->hash;
+            set_occupied(&new_table, new_entry, entry->hash);
             new_entry->key = entry->key;
             new_entry->value = entry->value;
         }
     }
 
     /* Update hash table. */
-    free(table->table);
+    free_table(table);
     *table = new_table;
 }
 
@@ -258,19 +479,18 @@ void *hash_table_insert(struct hash_table *table, const void *key, void *value)
     bool found;
     struct table_entry *entry = lookup(table, key, hash, &found);
 
-    /* Proper management of deleted and entry counts. */
-    if (entry->hash == EMPTY_HASH)
-        /* Adding a new entry. */
-        table->entries += 1;
-    else if (entry->hash == DELETED_HASH)
-        /* Overwriting a deleted key. */
-        table->deleted -= 1;
-    /* Otherwise updated a value in place, no action required. */
-
     if (!found)
     {
+        /* Proper management of deleted and entry counts. */
+        if (is_deleted(table, entry))
+            /* Overwriting a deleted key. */
+            table->deleted -= 1;
+        else
+            /* Adding a new entry. */
+            table->entries += 1;
+
         /* New entry, set up key and hash, copying key if necessary. */
-        entry->hash = hash;
+        set_occupied(table, entry, hash);
         if (table->key_ops->copy_key)
             entry->key = table->key_ops->copy_key(key);
         else
@@ -283,9 +503,8 @@ void *hash_table_insert(struct hash_table *table, const void *key, void *value)
     void *old_value = entry->value;
     entry->value = value;
 
-    /* Check for over-full hash table, expand if necessary, if more than 2/3
-     * full. */
-    if (3 * table->entries >= 2 * table->size_mask)
+    /* Check for over-full hash table, expand if necessary. */
+    if (over_full(table))
         resize_table(table, 0);
 
     return old_value;
@@ -302,10 +521,13 @@ void *hash_table_delete(struct hash_table *table, const void *key)
     {
         if (table->key_ops->release_key)
             release_key(table, entry->key);
-        entry->hash = DELETED_HASH;
         entry->key = NULL;
         entry->value = NULL;
-        table->deleted += 1;
+        if (set_deleted(table, entry))
+            table->deleted += 1;
+        else
+            /* Slot returned to empty, no tombstone required. */
+            table->entries -= 1;
     }
     return old_value;
 }
@@ -323,17 +545,35 @@ void hash_table_resize(struct hash_table *table, size_t min_size)
 }
 
 
+/* Resizing leaves at least half of the table free, so a table of twice the
+ * requested count can be filled without being resized again. */
+void hash_table_reserve(struct hash_table *table, size_t count)
+{
+    if (2 * count > table->size_mask + 1)
+        resize_table(table, 2 * count);
+}
+
+
+void hash_table_insert_bulk(
+    struct hash_table *table, size_t count,
+    const struct hash_table_pair pairs[])
+{
+    hash_table_reserve(table, hash_table_count(table) + count);
+    for (size_t i = 0; i < count; i ++)
+        hash_table_insert(table, pairs[i].key, pairs[i].value);
+}
+
+
 bool hash_table_walk(
     struct hash_table *table, int *ix, const void **key, void **value)
 {
-// printf("hash_table_walk %p, %p(%d), %p, %p\n", table, ix, *ix, key, value);
     if (*ix < 0)
         return false;
 
     for (; *ix <= (int) table->size_mask; (*ix) ++)
     {
         struct table_entry *entry = &table->table[*ix];
-        if (!empty_entry(entry))
+        if (occupied(table, (size_t) *ix))
         {
             if (key)
                 *key = entry->key;
@@ -347,7 +587,6 @@ bool hash_table_walk(
 }
 
 
-#if 0
 void hash_table_validate(struct hash_table *table)
 {
     size_t entries = 0;
@@ -357,23 +596,48 @@ void hash_table_validate(struct hash_table *table)
     for (size_t i = 0; i < size; i ++)
     {
         struct table_entry *entry = &table->table[i];
-        if (entry->hash != EMPTY_HASH)
+        validate_slot(table, i);
+        if (occupied(table, i))
         {
             entries += 1;
-            if (entry->hash == DELETED_HASH)
-                deleted += 1;
-            else
-            {
-                ASSERT_OK(entry->hash == compute_hash(table, entry->key));
-                bool found;
-                ASSERT_OK(lookup(
-                    table, entry->key, entry->hash, &found) == entry);
-                ASSERT_OK(found);
-            }
+            ASSERT_OK(entry->hash == compute_hash(table, entry->key));
+            bool found;
+            ASSERT_OK(lookup(
+                table, entry->key, entry->hash, &found) == entry);
+            ASSERT_OK(found);
         }
+        else if (is_deleted(table, entry))
+            deleted += 1;
     }
-    ASSERT_OK(entries == table->entries);
+    ASSERT_OK(entries + deleted == table->entries);
     ASSERT_OK(deleted == table->deleted);
-    ASSERT_OK(3 * table->entries < 2 * table->size_mask);
+    ASSERT_OK(!over_full(table));
+}
+
+
+void hash_table_get_stats(
+    struct hash_table *table, struct hash_table_stats *stats)
+{
+    *stats = (struct hash_table_stats) {
+        .size = table->size_mask + 1,
+        .entries = table->entries - table->deleted,
+        .deleted = table->deleted,
+    };
+    stats->load_factor =
+        (double) table->entries / (double) stats->size;
+
+    size_t total_probe = 0;
+    for (size_t i = 0; i <= table->size_mask; i ++)
+    {
+        if (occupied(table, i))
+        {
+            size_t length = probe_length(table, table->table[i].hash, i);
+            total_probe += length;
+            stats->max_probe = MAX(stats->max_probe, length);
+            stats->probe_histogram[
+                MIN(length, (size_t) HASH_TABLE_PROBE_HISTOGRAM) - 1] += 1;
+        }
+    }
+    if (stats->entries > 0)
+        stats->mean_probe = (double) total_probe / (double) stats->entries;
 }
-#endif
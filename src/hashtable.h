@@ -36,6 +36,21 @@ size_t hash_table_count(struct hash_table *table);
  * used after deleting entries to compress table. */
 void hash_table_resize(struct hash_table *table, size_t min_size);
 
+/* Ensures that the table can hold count entries without being resized.  Call
+ * this after creating a table of known size to avoid repeatedly rehashing the
+ * table while it is filled. */
+void hash_table_reserve(struct hash_table *table, size_t count);
+
+/* Inserts an array of (key,value) pairs, sizing the table for all of them
+ * first.  Equivalent to calling hash_table_insert() for each pair in turn. */
+struct hash_table_pair {
+    const void *key;
+    void *value;
+};
+void hash_table_insert_bulk(
+    struct hash_table *table, size_t count,
+    const struct hash_table_pair pairs[]);
+
 /* Iterator for walking all entries in hash table.  The table *must* remain
  * unchanged during the walk.  Start by initialising ix to zero, each call
  * will increment ix and return the associated (key,value) pair and return
@@ -50,6 +65,25 @@ bool hash_table_walk(
  * key lifetime mismanagement. */
 void hash_table_validate(struct hash_table *table);
 
+/* Statistics on hash table occupancy and the probe lengths of present keys.  A
+ * probe step examines a group of slots in the default layout and a single slot
+ * in the original layout, so the numbers are only comparable within a layout.
+ * The last bucket of the histogram also counts all longer probes. */
+#define HASH_TABLE_PROBE_HISTOGRAM  8
+struct hash_table_stats {
+    size_t size;                // Number of slots in table
+    size_t entries;             // Number of keys present
+    size_t deleted;             // Number of deleted slots, "tombstones"
+    double load_factor;         // Fraction of slots present or deleted
+    double mean_probe;          // Mean probe length of present keys
+    size_t max_probe;           // Longest probe length
+    size_t probe_histogram[HASH_TABLE_PROBE_HISTOGRAM];
+};
+
+/* Computes statistics for table.  This walks the entire table. */
+void hash_table_get_stats(
+    struct hash_table *table, struct hash_table_stats *stats);
+
 
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
@@ -83,3 +117,9 @@ struct hash_table *hash_table_create_generic(const struct hash_table_ops *ops);
 
 /* Hash table keyed by pointers.  Also use this for integer indexed tables. */
 struct hash_table *hash_table_create_ptrs(void);
+
+/* Hash functions used for string and pointer keys, also available for building
+ * hash functions for other key types.  Hashes are not stable between builds or
+ * architectures, so should not be stored. */
+hash_t hash_table_hash_bytes(const void *data, size_t length);
+hash_t hash_table_hash_ptr(const void *key);
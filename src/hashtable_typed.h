@@ -0,0 +1,850 @@
+/* Type specialised hash tables.
+ *
+ * Must be included after error.h and hashtable.h.  The macro DEFINE_HASH_TABLE
+ * generates a hash table type with keys and values of the given types, where
+ * the hash and comparison functions are inlined into lookup rather than called
+ * through the hash_table_ops pointers.  DEFINE_CONCURRENT_HASH_TABLE generates
+ * a variant which can be read by many threads without locking while it is
+ * being updated.  The table layout is the same as the "Swiss table" layout of
+ * hashtable.c, and the group matching and hashing primitives below are shared
+ * with it. */
+
+#include <pthread.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Hashing primitives. */
+
+/* String hashing follows the structure of wyhash: the key is consumed 16 bytes
+ * at a time, each step folding the 128-bit product of two 64-bit words into
+ * the running state.  Our keys are PV names of 20 to 60 characters with long
+ * shared prefixes, so reading whole words rather than bytes matters, and the
+ * multiply ensures that every input bit affects every output bit. */
+#define _HASH_SECRET_0  UINT64_C(0xa0761d6478bd642f)
+#define _HASH_SECRET_1  UINT64_C(0xe7037ed1a0b428db)
+#define _HASH_SECRET_2  UINT64_C(0x8ebc6af09c88c6e3)
+
+/* Returns the high and low halves of a * b xored together.  Not all of our
+ * targets support 128 bit arithmetic, so we provide a portable fallback. */
+#ifdef __SIZEOF_INT128__
+static inline uint64_t _hash_mix_multiply(uint64_t a, uint64_t b)
+{
+    unsigned __int128 product = (unsigned __int128) a * b;
+    return (uint64_t) product ^ (uint64_t) (product >> 64);
+}
+#else
+static inline uint64_t _hash_mix_multiply(uint64_t a, uint64_t b)
+{
+    uint64_t a_lo = (uint32_t) a;
+    uint64_t a_hi = a >> 32;
+    uint64_t b_lo = (uint32_t) b;
+    uint64_t b_hi = b >> 32;
+
+    uint64_t b00 = a_lo * b_lo;
+    uint64_t b01 = a_lo * b_hi;
+    uint64_t b10 = a_hi * b_lo;
+    uint64_t b11 = a_hi * b_hi;
+
+    uint64_t mid1 = b10 + (b00 >> 32);
+    uint64_t mid2 = b01 + (uint32_t) mid1;
+    uint64_t high = b11 + (mid1 >> 32) + (mid2 >> 32);
+    uint64_t low = (mid2 << 32) | (uint32_t) b00;
+    return high ^ low;
+}
+#endif
+
+
+static inline uint64_t _hash_read_64(const uint8_t *p)
+{
+    uint64_t result;
+    memcpy(&result, p, sizeof(result));
+    return result;
+}
+
+static inline uint64_t _hash_read_32(const uint8_t *p)
+{
+    uint32_t result;
+    memcpy(&result, p, sizeof(result));
+    return result;
+}
+
+
+static inline hash_t _hash_bytes(const void *data, size_t length)
+{
+    const uint8_t *p = data;
+    uint64_t seed = _hash_mix_multiply(
+        _HASH_SECRET_0 ^ length, _HASH_SECRET_1 ^ (uint64_t) length << 32);
+    uint64_t a, b;
+    if (length <= 16)
+    {
+        /* Short keys are read as two possibly overlapping words, or as
+         * overlapping 32-bit halves, or as three possibly repeated bytes. */
+        if (length >= 8)
+        {
+            a = _hash_read_64(p);
+            b = _hash_read_64(p + length - 8);
+        }
+        else if (length >= 4)
+        {
+            a = _hash_read_32(p) << 32 | _hash_read_32(p + length - 4);
+            b = 0;
+        }
+        else if (length > 0)
+        {
+            a = (uint64_t) p[0] << 16 | (uint64_t) p[length / 2] << 8 |
+                p[length - 1];
+            b = 0;
+        }
+        else
+            a = b = 0;
+    }
+    else
+    {
+        size_t remaining = length;
+        for (; remaining > 16; remaining -= 16, p += 16)
+            seed = _hash_mix_multiply(
+                _hash_read_64(p) ^ _HASH_SECRET_1, _hash_read_64(p + 8) ^ seed);
+        /* The final 16 bytes overlap the last block if necessary. */
+        a = _hash_read_64(p + remaining - 16);
+        b = _hash_read_64(p + remaining - 8);
+    }
+    return _hash_mix_multiply(
+        _HASH_SECRET_2 ^ length,
+        _hash_mix_multiply(a ^ _HASH_SECRET_1, b ^ seed));
+}
+
+
+/* Pointers have their low bits clear and their high bits mostly the same, so a
+ * single multiply spreads the remaining bits over the whole hash. */
+static inline hash_t _hash_ptr(const void *key)
+{
+    return _hash_mix_multiply(
+        (uint64_t) (uintptr_t) key ^ _HASH_SECRET_0, _HASH_SECRET_1);
+}
+
+
+/* Hash and compare functions for the two common key types. */
+static inline hash_t hash_string_key(const char *key)
+{
+    return _hash_bytes(key, strlen(key));
+}
+
+static inline bool compare_string_key(const char *key1, const char *key2)
+{
+    return strcmp(key1, key2) == 0;
+}
+
+static inline hash_t hash_ptr_key(const void *key)
+{
+    return _hash_ptr(key);
+}
+
+static inline bool compare_ptr_key(const void *key1, const void *key2)
+{
+    return key1 == key2;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Group matching primitives. */
+
+/* Every entry has a control tag: either one of the two values below, or the
+ * bottom 7 bits of the entry's hash.  The table is divided into aligned groups
+ * of _HASH_GROUP_SIZE entries, and the tags of a group are compared with a
+ * search tag in a single operation.  A probe sequence visits groups in
+ * triangular order, which visits every group as the number of groups is a
+ * power of 2, and only ends at a group with an empty slot.  The full hash is
+ * stored in each entry so that false tag matches only rarely need a call to
+ * compare. */
+#define _HASH_CONTROL_EMPTY     0x80    // Marks unused slot
+#define _HASH_CONTROL_DELETED   0xFE    // Marks deleted slot, "tombstone"
+
+/* Each group operation returns a bit mask with one bit set for each matching
+ * slot, with bits spaced 1 << _HASH_MASK_SHIFT apart. */
+#if defined(__SSE2__)
+#define _HASH_GROUP_SIZE    16
+#define _HASH_MASK_SHIFT    0
+typedef uint32_t _hash_group_mask_t;
+
+static inline _hash_group_mask_t _hash_match_tag(
+    const uint8_t *control, uint8_t tag)
+{
+    __m128i group = _mm_loadu_si128((const __m128i *) control);
+    return (_hash_group_mask_t) _mm_movemask_epi8(
+        _mm_cmpeq_epi8(group, _mm_set1_epi8((char) tag)));
+}
+
+static inline _hash_group_mask_t _hash_match_empty(const uint8_t *control)
+{
+    return _hash_match_tag(control, _HASH_CONTROL_EMPTY);
+}
+
+/* Empty and deleted tags are the only ones with the top bit set. */
+static inline _hash_group_mask_t _hash_match_free(const uint8_t *control)
+{
+    __m128i group = _mm_loadu_si128((const __m128i *) control);
+    return (_hash_group_mask_t) _mm_movemask_epi8(group);
+}
+
+#elif defined(__ARM_NEON)
+#define _HASH_GROUP_SIZE    16
+#define _HASH_MASK_SHIFT    2
+typedef uint64_t _hash_group_mask_t;
+
+/* NEON has no movemask, instead narrowing each 16-bit lane of the comparison
+ * result to 8 bits gives four bits for each slot, of which we keep one. */
+static inline _hash_group_mask_t _hash_narrow_mask(uint8x16_t match)
+{
+    uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(match), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(narrowed), 0) &
+        UINT64_C(0x8888888888888888);
+}
+
+static inline _hash_group_mask_t _hash_match_tag(
+    const uint8_t *control, uint8_t tag)
+{
+    return _hash_narrow_mask(vceqq_u8(vld1q_u8(control), vdupq_n_u8(tag)));
+}
+
+static inline _hash_group_mask_t _hash_match_empty(const uint8_t *control)
+{
+    return _hash_match_tag(control, _HASH_CONTROL_EMPTY);
+}
+
+static inline _hash_group_mask_t _hash_match_free(const uint8_t *control)
+{
+    int8x16_t group = vreinterpretq_s8_u8(vld1q_u8(control));
+    return _hash_narrow_mask(vcltq_s8(group, vdupq_n_s8(0)));
+}
+
+#else
+/* Portable fallback, treating groups of 8 tags as a 64-bit word. */
+#define _HASH_GROUP_SIZE    8
+#define _HASH_MASK_SHIFT    3
+typedef uint64_t _hash_group_mask_t;
+
+#define _HASH_LSBS  UINT64_C(0x0101010101010101)
+#define _HASH_MSBS  UINT64_C(0x8080808080808080)
+
+static inline uint64_t _hash_load_group(const uint8_t *control)
+{
+    uint64_t group;
+    memcpy(&group, control, sizeof(group));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    group = __builtin_bswap64(group);
+#endif
+    return group;
+}
+
+/* Sets the top bit of every zero byte of x ^ tag.  This can also flag a byte
+ * above a true match, which is harmless as the hash is checked in full. */
+static inline _hash_group_mask_t _hash_match_tag(
+    const uint8_t *control, uint8_t tag)
+{
+    uint64_t x = _hash_load_group(control) ^ (_HASH_LSBS * tag);
+    return (x - _HASH_LSBS) & ~x & _HASH_MSBS;
+}
+
+/* Of the tags with the top bit set only empty has bit 1 clear. */
+static inline _hash_group_mask_t _hash_match_empty(const uint8_t *control)
+{
+    uint64_t group = _hash_load_group(control);
+    return group & ~(group << 6) & _HASH_MSBS;
+}
+
+static inline _hash_group_mask_t _hash_match_free(const uint8_t *control)
+{
+    return _hash_load_group(control) & _HASH_MSBS;
+}
+#endif
+
+
+/* Returns the index of the first slot in a non zero group mask. */
+static inline size_t _hash_first_slot(_hash_group_mask_t mask)
+{
+    return (size_t) __builtin_ctzll(mask) >> _HASH_MASK_SHIFT;
+}
+
+static inline uint8_t _hash_tag(hash_t hash)
+{
+    return (uint8_t) (hash & 0x7F);
+}
+
+static inline bool _hash_occupied(const uint8_t *control, size_t ix)
+{
+    return (control[ix] & 0x80) == 0;
+}
+
+
+/* Returns a freshly allocated array of size empty control tags. */
+static inline uint8_t *_hash_create_control(size_t size)
+{
+    uint8_t *control = malloc(size);
+    memset(control, _HASH_CONTROL_EMPTY, size);
+    return control;
+}
+
+
+/* Walks the probe sequence for hash evaluating the expression match, with ix
+ * set to the slot, for each slot with a matching tag until match is true.
+ * Returns the slot found, or if match is never true the first slot on the probe
+ * sequence selected by match_free, normally _hash_match_free, where the key can
+ * be inserted, with *found set accordingly. */
+#define _HASH_PROBE(control, size_mask, hash, found, ix, match, match_free) \
+    ( { \
+        uint8_t _tag = _hash_tag(hash); \
+        size_t _group_mask = (size_mask) / _HASH_GROUP_SIZE; \
+        size_t _group = (size_t) ((hash) >> 7) & _group_mask; \
+        size_t _free = SIZE_MAX; \
+        size_t _result; \
+        for (size_t _stride = 1; ; \
+             _group = (_group + _stride++) & _group_mask) \
+        { \
+            size_t _base = _group * _HASH_GROUP_SIZE; \
+            const uint8_t *_control = &(control)[_base]; \
+            _hash_group_mask_t _match = _hash_match_tag(_control, _tag); \
+            for (; _match; _match &= _match - 1) \
+            { \
+                size_t ix __attribute__((unused)) = \
+                    _base + _hash_first_slot(_match); \
+                if (match) \
+                    break; \
+            } \
+            if (_match) \
+            { \
+                *(found) = true; \
+                _result = _base + _hash_first_slot(_match); \
+                break; \
+            } \
+            /* Remember the first free slot in case the key is absent. */ \
+            if (_free == SIZE_MAX) \
+            { \
+                _hash_group_mask_t _free_slots = match_free(_control); \
+                if (_free_slots) \
+                    _free = _base + _hash_first_slot(_free_slots); \
+            } \
+            /* A group with an empty slot ends the probe sequence. */ \
+            if (_hash_match_empty(_control)) \
+            { \
+                *(found) = false; \
+                _result = _free; \
+                break; \
+            } \
+        } \
+        _result; \
+    } )
+
+
+/* Marks slot ix as deleted.  If the group still has an empty slot then it has
+ * never been full since the table was built, so no probe sequence has ever
+ * passed through it and the slot can be marked empty again instead of leaving
+ * a tombstone.  Returns true if a tombstone was left. */
+static inline bool _hash_set_deleted(uint8_t *control, size_t ix)
+{
+    bool tombstone =
+        !_hash_match_empty(&control[ix & ~(size_t) (_HASH_GROUP_SIZE - 1)]);
+    control[ix] = tombstone ? _HASH_CONTROL_DELETED : _HASH_CONTROL_EMPTY;
+    return tombstone;
+}
+
+
+/* Probe sequences end at groups with an empty slot, so the table can be
+ * allowed to fill up to 7/8 full, counting tombstones. */
+static inline bool _hash_over_full(size_t entries, size_t size_mask)
+{
+    return 8 * entries >= 7 * (size_mask + 1);
+}
+
+
+/* Returns the table size, a power of 2, needed to hold entries with at least
+ * 50% of the table free, and at least min_size. */
+static inline size_t _hash_table_size(size_t entries, size_t min_size)
+{
+    size_t size = _HASH_GROUP_SIZE;
+    while (size < min_size  ||  size < 2 * entries)
+        size <<= 1;
+    return size;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Typed hash tables. */
+
+/* Generates the following type and functions for a hash table mapping key_type
+ * to value_type, where hash(key) returns a hash_t which must be well mixed in
+ * all bits and compare(key1, key2) returns true iff the keys are equal:
+ *
+ *  struct name
+ *  struct name *name##_create(void)
+ *  void name##_destroy(struct name *table)
+ *  value_type name##_lookup(struct name *table, key_type key)
+ *  bool name##_lookup_bool(
+ *      struct name *table, key_type key, value_type *value)
+ *  value_type name##_insert(struct name *table, key_type key, value_type value)
+ *  value_type name##_delete(struct name *table, key_type key)
+ *  size_t name##_count(struct name *table)
+ *  void name##_resize(struct name *table, size_t min_size)
+ *  void name##_reserve(struct name *table, size_t count)
+ *  bool name##_walk(
+ *      struct name *table, size_t *ix, key_type *key, value_type *value)
+ *
+ * These behave as the corresponding hash_table_ functions, except that the
+ * caller always manages key lifetime and the walk index is a size_t.  Where the
+ * key is not present a zero value_type is returned.  Unused table entries are
+ * kept zeroed so that lookup can simply return the value from the slot found.
+ * Either key or value can be NULL in _walk. */
+#define DEFINE_HASH_TABLE(name, key_type, value_type, hash, compare) \
+    struct name##_entry { \
+        hash_t hash; \
+        key_type key; \
+        value_type value; \
+    }; \
+    \
+    struct name { \
+        size_t entries;     /* Number of entries, including deleted */ \
+        size_t deleted;     /* Number of deleted entries in table */ \
+        size_t size_mask;   /* Size is power of 2, mask selects modulo */ \
+        uint8_t *control;   /* One control tag for each entry in table */ \
+        struct name##_entry *table; \
+    }; \
+    \
+    static inline __attribute__((unused)) void _##name##_allocate( \
+        struct name *table, size_t size) \
+    { \
+        table->size_mask = size - 1; \
+        table->control = _hash_create_control(size); \
+        table->table = calloc(size, sizeof(struct name##_entry)); \
+    } \
+    \
+    static inline __attribute__((unused)) struct name *name##_create(void) \
+    { \
+        struct name *table = malloc(sizeof(struct name)); \
+        *table = (struct name) { .entries = 0, .deleted = 0, }; \
+        _##name##_allocate(table, _HASH_GROUP_SIZE); \
+        return table; \
+    } \
+    \
+    static inline __attribute__((unused)) void name##_destroy( \
+        struct name *table) \
+    { \
+        free(table->control); \
+        free(table->table); \
+        free(table); \
+    } \
+    \
+    static inline __attribute__((unused)) size_t _##name##_find( \
+        struct name *table, key_type key, hash_t key_hash, bool *found) \
+    { \
+        struct name##_entry *entries = table->table; \
+        return _HASH_PROBE(table->control, table->size_mask, key_hash, \
+            found, ix, \
+            entries[ix].hash == key_hash  &&  compare(key, entries[ix].key), \
+            _hash_match_free); \
+    } \
+    \
+    static inline __attribute__((unused)) value_type name##_lookup( \
+        struct name *table, key_type key) \
+    { \
+        bool found; \
+        return table->table[_##name##_find(table, key, hash(key), &found)] \
+            .value; \
+    } \
+    \
+    static inline __attribute__((unused)) bool name##_lookup_bool( \
+        struct name *table, key_type key, value_type *value) \
+    { \
+        bool found; \
+        *value = table->table[_##name##_find(table, key, hash(key), &found)] \
+            .value; \
+        return found; \
+    } \
+    \
+    static inline __attribute__((unused)) void name##_resize( \
+        struct name *table, size_t min_size) \
+    { \
+        struct name new_table = { \
+            .entries = table->entries - table->deleted, \
+            .deleted = 0, \
+        }; \
+        _##name##_allocate(&new_table, \
+            _hash_table_size(new_table.entries, min_size)); \
+        for (size_t ix = 0; ix <= table->size_mask; ix ++) \
+        { \
+            if (_hash_occupied(table->control, ix)) \
+            { \
+                struct name##_entry *entry = &table->table[ix]; \
+                bool found; \
+                /* Keys are all distinct, so we just need a free slot. */ \
+                size_t new_ix = _HASH_PROBE(new_table.control, \
+                    new_table.size_mask, entry->hash, &found, _ix, false, \
+                    _hash_match_free); \
+                new_table.control[new_ix] = _hash_tag(entry->hash); \
+                new_table.table[new_ix] = *entry; \
+            } \
+        } \
+        free(table->control); \
+        free(table->table); \
+        *table = new_table; \
+    } \
+    \
+    static inline __attribute__((unused)) value_type name##_insert( \
+        struct name *table, key_type key, value_type value) \
+    { \
+        hash_t key_hash = hash(key); \
+        bool found; \
+        size_t ix = _##name##_find(table, key, key_hash, &found); \
+        struct name##_entry *entry = &table->table[ix]; \
+        value_type old_value = entry->value; \
+        if (!found) \
+        { \
+            if (table->control[ix] == _HASH_CONTROL_DELETED) \
+                table->deleted -= 1; \
+            else \
+                table->entries += 1; \
+            table->control[ix] = _hash_tag(key_hash); \
+            entry->hash = key_hash; \
+        } \
+        entry->key = key; \
+        entry->value = value; \
+        if (_hash_over_full(table->entries, table->size_mask)) \
+            name##_resize(table, 0); \
+        return old_value; \
+    } \
+    \
+    static inline __attribute__((unused)) value_type name##_delete( \
+        struct name *table, key_type key) \
+    { \
+        bool found; \
+        size_t ix = _##name##_find(table, key, hash(key), &found); \
+        struct name##_entry *entry = &table->table[ix]; \
+        value_type old_value = entry->value; \
+        if (found) \
+        { \
+            if (_hash_set_deleted(table->control, ix)) \
+                table->deleted += 1; \
+            else \
+                table->entries -= 1; \
+            *entry = (struct name##_entry) { .hash = 0, }; \
+        } \
+        return old_value; \
+    } \
+    \
+    static inline __attribute__((unused)) size_t name##_count( \
+        struct name *table) \
+    { \
+        return table->entries - table->deleted; \
+    } \
+    \
+    static inline __attribute__((unused)) void name##_reserve( \
+        struct name *table, size_t count) \
+    { \
+        if (2 * count > table->size_mask + 1) \
+            name##_resize(table, 2 * count); \
+    } \
+    \
+    static inline __attribute__((unused)) bool name##_walk( \
+        struct name *table, size_t *ix, key_type *key, value_type *value) \
+    { \
+        for (; *ix <= table->size_mask; (*ix) ++) \
+        { \
+            if (_hash_occupied(table->control, *ix)) \
+            { \
+                if (key) \
+                    *key = table->table[*ix].key; \
+                if (value) \
+                    *value = table->table[*ix].value; \
+                (*ix) += 1; \
+                return true; \
+            } \
+        } \
+        return false; \
+    }
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Concurrent typed hash tables. */
+
+/* Generates a read-mostly hash table type where lookups take no locks and are
+ * wait free, and can run on any number of threads while other threads are
+ * changing the table.  Changes are serialised by a mutex held in the table.
+ * The following functions are generated, together with struct name and
+ * struct name##_cursor:
+ *
+ *  struct name *name##_create(void)
+ *  void name##_destroy(struct name *table)
+ *  value_type name##_lookup(struct name *table, key_type key)
+ *  bool name##_lookup_bool(
+ *      struct name *table, key_type key, value_type *value)
+ *  value_type name##_add(struct name *table, key_type key, value_type value)
+ *  value_type name##_delete(struct name *table, key_type key)
+ *  size_t name##_count(struct name *table)
+ *  void name##_resize(struct name *table, size_t min_size)
+ *  void name##_reserve(struct name *table, size_t count)
+ *  struct name##_cursor name##_walk_start(struct name *table)
+ *  bool name##_walk(
+ *      struct name##_cursor *cursor, key_type *key, value_type *value)
+ *
+ * The table contents are held in a snapshot which readers load once with
+ * acquire ordering.  A writer fills in an entry before publishing its control
+ * tag with release ordering, and an entry is never changed while its snapshot
+ * is in use: existing values are never replaced, so _add returns the existing
+ * value if the key is already present, and deleted slots are left as
+ * tombstones until the table is rebuilt.  Resizing builds a complete new
+ * snapshot which then replaces the current one, in the style of RCU.
+ *
+ * Readers may still be using the replaced snapshot, and we have no way of
+ * knowing when they have finished, so replaced snapshots are only freed when
+ * the table is destroyed.  As the table doubles on each resize this at most
+ * doubles the memory used by a table which only grows.  For the same reason a
+ * key and value returned by _delete may still be seen by concurrent readers,
+ * and the caller must not release them until all such readers are done.
+ *
+ * The group match in the probe sequence reads the control tags without
+ * synchronisation, so can see a tag which is being changed.  This is harmless
+ * as the tag of any matching slot is loaded again with acquire ordering before
+ * its entry is read, and a key whose tag is not yet visible is simply one whose
+ * addition has not yet completed.
+ *
+ * A walk runs over the snapshot current when name##_walk_start() is called, so
+ * no entry present throughout the walk is skipped or repeated, but entries
+ * added or deleted during the walk may or may not be seen. */
+#define DEFINE_CONCURRENT_HASH_TABLE( \
+        name, key_type, value_type, hash, compare) \
+    struct name##_entry { \
+        hash_t hash; \
+        key_type key; \
+        value_type value; \
+    }; \
+    \
+    struct name##_snapshot { \
+        size_t entries;     /* Number of entries, including deleted */ \
+        size_t deleted;     /* Number of deleted entries in table */ \
+        size_t size_mask;   /* Size is power of 2, mask selects modulo */ \
+        uint8_t *control;   /* One control tag for each entry in table */ \
+        struct name##_entry *table; \
+        struct name##_snapshot *replaced;   /* Freed on destroy */ \
+    }; \
+    \
+    struct name { \
+        struct name##_snapshot *snapshot; \
+        pthread_mutex_t mutex;  /* Serialises all changes */ \
+    }; \
+    \
+    struct name##_cursor { \
+        struct name##_snapshot *snapshot; \
+        size_t ix; \
+    }; \
+    \
+    static inline __attribute__((unused)) struct name##_snapshot * \
+        _##name##_allocate(size_t size, struct name##_snapshot *replaced) \
+    { \
+        struct name##_snapshot *snapshot = \
+            malloc(sizeof(struct name##_snapshot)); \
+        *snapshot = (struct name##_snapshot) { \
+            .entries = 0, \
+            .deleted = 0, \
+            .size_mask = size - 1, \
+            .control = _hash_create_control(size), \
+            .table = calloc(size, sizeof(struct name##_entry)), \
+            .replaced = replaced, \
+        }; \
+        return snapshot; \
+    } \
+    \
+    static inline __attribute__((unused)) struct name *name##_create(void) \
+    { \
+        struct name *table = malloc(sizeof(struct name)); \
+        *table = (struct name) { \
+            .snapshot = _##name##_allocate(_HASH_GROUP_SIZE, NULL), \
+            .mutex = PTHREAD_MUTEX_INITIALIZER, \
+        }; \
+        return table; \
+    } \
+    \
+    static inline __attribute__((unused)) void name##_destroy( \
+        struct name *table) \
+    { \
+        struct name##_snapshot *snapshot = table->snapshot; \
+        while (snapshot) \
+        { \
+            struct name##_snapshot *replaced = snapshot->replaced; \
+            free(snapshot->control); \
+            free(snapshot->table); \
+            free(snapshot); \
+            snapshot = replaced; \
+        } \
+        ASSERT_PTHREAD(pthread_mutex_destroy(&table->mutex)); \
+        free(table); \
+    } \
+    \
+    /* The tag found by the group match is loaded again with acquire ordering \
+     * before the entry is read, and only empty slots are used for new keys \
+     * so that no entry being read can be overwritten. */ \
+    static inline __attribute__((unused)) size_t _##name##_find( \
+        struct name##_snapshot *snapshot, key_type key, hash_t key_hash, \
+        bool *found) \
+    { \
+        uint8_t *control = snapshot->control; \
+        struct name##_entry *entries = snapshot->table; \
+        return _HASH_PROBE(control, snapshot->size_mask, key_hash, \
+            found, ix, \
+            __atomic_load_n(&control[ix], __ATOMIC_ACQUIRE) == \
+                _hash_tag(key_hash)  && \
+            entries[ix].hash == key_hash  &&  compare(key, entries[ix].key), \
+            _hash_match_empty); \
+    } \
+    \
+    static inline __attribute__((unused)) bool name##_lookup_bool( \
+        struct name *table, key_type key, value_type *value) \
+    { \
+        struct name##_snapshot *snapshot = \
+            __atomic_load_n(&table->snapshot, __ATOMIC_ACQUIRE); \
+        bool found; \
+        size_t ix = _##name##_find(snapshot, key, hash(key), &found); \
+        if (found) \
+            *value = snapshot->table[ix].value; \
+        else \
+            memset(value, 0, sizeof(value_type)); \
+        return found; \
+    } \
+    \
+    static inline __attribute__((unused)) value_type name##_lookup( \
+        struct name *table, key_type key) \
+    { \
+        value_type value; \
+        name##_lookup_bool(table, key, &value); \
+        return value; \
+    } \
+    \
+    /* Builds and publishes a new snapshot.  Called with the mutex held. */ \
+    static inline __attribute__((unused)) void _##name##_rebuild( \
+        struct name *table, size_t min_size) \
+    { \
+        struct name##_snapshot *snapshot = table->snapshot; \
+        size_t entries = snapshot->entries - snapshot->deleted; \
+        struct name##_snapshot *new_snapshot = _##name##_allocate( \
+            _hash_table_size(entries, min_size), snapshot); \
+        new_snapshot->entries = entries; \
+        for (size_t ix = 0; ix <= snapshot->size_mask; ix ++) \
+        { \
+            if (_hash_occupied(snapshot->control, ix)) \
+            { \
+                struct name##_entry *entry = &snapshot->table[ix]; \
+                bool found; \
+                /* Keys are all distinct, so we just need a free slot. */ \
+                size_t new_ix = _HASH_PROBE(new_snapshot->control, \
+                    new_snapshot->size_mask, entry->hash, &found, _ix, \
+                    false, _hash_match_empty); \
+                new_snapshot->control[new_ix] = _hash_tag(entry->hash); \
+                new_snapshot->table[new_ix] = *entry; \
+            } \
+        } \
+        __atomic_store_n(&table->snapshot, new_snapshot, __ATOMIC_RELEASE); \
+    } \
+    \
+    static inline __attribute__((unused)) void name##_resize( \
+        struct name *table, size_t min_size) \
+    { \
+        ASSERT_PTHREAD(pthread_mutex_lock(&table->mutex)); \
+        _##name##_rebuild(table, min_size); \
+        ASSERT_PTHREAD(pthread_mutex_unlock(&table->mutex)); \
+    } \
+    \
+    static inline __attribute__((unused)) void name##_reserve( \
+        struct name *table, size_t count) \
+    { \
+        ASSERT_PTHREAD(pthread_mutex_lock(&table->mutex)); \
+        if (2 * count > table->snapshot->size_mask + 1) \
+            _##name##_rebuild(table, 2 * count); \
+        ASSERT_PTHREAD(pthread_mutex_unlock(&table->mutex)); \
+    } \
+    \
+    static inline __attribute__((unused)) value_type name##_add( \
+        struct name *table, key_type key, value_type value) \
+    { \
+        hash_t key_hash = hash(key); \
+        value_type old_value; \
+        memset(&old_value, 0, sizeof(value_type)); \
+        ASSERT_PTHREAD(pthread_mutex_lock(&table->mutex)); \
+        struct name##_snapshot *snapshot = table->snapshot; \
+        bool found; \
+        size_t ix = _##name##_find(snapshot, key, key_hash, &found); \
+        if (found) \
+            old_value = snapshot->table[ix].value; \
+        else \
+        { \
+            snapshot->table[ix] = (struct name##_entry) { \
+                .hash = key_hash, .key = key, .value = value, }; \
+            __atomic_store_n(&snapshot->control[ix], _hash_tag(key_hash), \
+                __ATOMIC_RELEASE); \
+            snapshot->entries += 1; \
+            if (_hash_over_full(snapshot->entries, snapshot->size_mask)) \
+                _##name##_rebuild(table, 0); \
+        } \
+        ASSERT_PTHREAD(pthread_mutex_unlock(&table->mutex)); \
+        return old_value; \
+    } \
+    \
+    static inline __attribute__((unused)) value_type name##_delete( \
+        struct name *table, key_type key) \
+    { \
+        value_type old_value; \
+        memset(&old_value, 0, sizeof(value_type)); \
+        ASSERT_PTHREAD(pthread_mutex_lock(&table->mutex)); \
+        struct name##_snapshot *snapshot = table->snapshot; \
+        bool found; \
+        size_t ix = _##name##_find(snapshot, key, hash(key), &found); \
+        if (found) \
+        { \
+            old_value = snapshot->table[ix].value; \
+            __atomic_store_n(&snapshot->control[ix], _HASH_CONTROL_DELETED, \
+                __ATOMIC_RELEASE); \
+            snapshot->deleted += 1; \
+        } \
+        ASSERT_PTHREAD(pthread_mutex_unlock(&table->mutex)); \
+        return old_value; \
+    } \
+    \
+    static inline __attribute__((unused)) size_t name##_count( \
+        struct name *table) \
+    { \
+        ASSERT_PTHREAD(pthread_mutex_lock(&table->mutex)); \
+        size_t count = table->snapshot->entries - table->snapshot->deleted; \
+        ASSERT_PTHREAD(pthread_mutex_unlock(&table->mutex)); \
+        return count; \
+    } \
+    \
+    static inline __attribute__((unused)) struct name##_cursor \
+        name##_walk_start(struct name *table) \
+    { \
+        struct name##_snapshot *snapshot = \
+            __atomic_load_n(&table->snapshot, __ATOMIC_ACQUIRE); \
+        return (struct name##_cursor) { .snapshot = snapshot, .ix = 0, }; \
+    } \
+    \
+    static inline __attribute__((unused)) bool name##_walk( \
+        struct name##_cursor *cursor, key_type *key, value_type *value) \
+    { \
+        struct name##_snapshot *snapshot = cursor->snapshot; \
+        for (; cursor->ix <= snapshot->size_mask; cursor->ix ++) \
+        { \
+            uint8_t tag = __atomic_load_n( \
+                &snapshot->control[cursor->ix], __ATOMIC_ACQUIRE); \
+            if ((tag & 0x80) == 0) \
+            { \
+                if (key) \
+                    *key = snapshot->table[cursor->ix].key; \
+                if (value) \
+                    *value = snapshot->table[cursor->ix].value; \
+                cursor->ix += 1; \
+                return true; \
+            } \
+        } \
+        return false; \
+    }
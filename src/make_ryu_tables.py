@@ -0,0 +1,71 @@
+#!/usr/bin/env python3
+
+# Generates the power of five tables used by number_format.c for shortest round
+# trip formatting of floating point numbers, see ryu_tables.h.
+#
+# Usage: make_ryu_tables.py > ryu_tables.h
+
+DOUBLE_POW5_INV_BITCOUNT = 125
+DOUBLE_POW5_BITCOUNT = 125
+DOUBLE_POW5_INV_TABLE_SIZE = 342
+DOUBLE_POW5_TABLE_SIZE = 326
+
+FLOAT_POW5_INV_BITCOUNT = 59
+FLOAT_POW5_BITCOUNT = 61
+FLOAT_POW5_INV_TABLE_SIZE = 31
+FLOAT_POW5_TABLE_SIZE = 47
+
+
+# Entry i is 5^i scaled to exactly bitcount bits.
+def pow5_split(size, bitcount):
+    for i in range(size):
+        pow5 = 5 ** i
+        shift = pow5.bit_length() - bitcount
+        yield pow5 >> shift if shift >= 0 else pow5 << -shift
+
+# Entry i is 2^(bitlength(5^i) - 1 + bitcount) / 5^i rounded up.
+def pow5_inv_split(size, bitcount):
+    for i in range(size):
+        pow5 = 5 ** i
+        yield (1 << (pow5.bit_length() - 1 + bitcount)) // pow5 + 1
+
+
+def print_table_128(name, values):
+    print('static const uint64_t %s[][2] = {' % name)
+    for value in values:
+        assert value < 1 << 128
+        print('    { %#018xu, %#018xu },' % (
+            value & ((1 << 64) - 1), value >> 64))
+    print('};')
+    print()
+
+def print_table_64(name, values):
+    print('static const uint64_t %s[] = {' % name)
+    for value in values:
+        assert value < 1 << 64
+        print('    %#018xu,' % value)
+    print('};')
+    print()
+
+
+print('''\
+/* Power of five tables for shortest round trip number formatting.
+ *
+ * This file is generated by make_ryu_tables.py, do not edit. */
+''')
+for name, value in [
+        ('DOUBLE_POW5_INV_BITCOUNT', DOUBLE_POW5_INV_BITCOUNT),
+        ('DOUBLE_POW5_BITCOUNT', DOUBLE_POW5_BITCOUNT),
+        ('FLOAT_POW5_INV_BITCOUNT', FLOAT_POW5_INV_BITCOUNT),
+        ('FLOAT_POW5_BITCOUNT', FLOAT_POW5_BITCOUNT)]:
+    print('#define %-28s %d' % (name, value))
+print()
+
+print_table_128('DOUBLE_POW5_INV_SPLIT',
+    pow5_inv_split(DOUBLE_POW5_INV_TABLE_SIZE, DOUBLE_POW5_INV_BITCOUNT))
+print_table_128('DOUBLE_POW5_SPLIT',
+    pow5_split(DOUBLE_POW5_TABLE_SIZE, DOUBLE_POW5_BITCOUNT))
+print_table_64('FLOAT_POW5_INV_SPLIT',
+    pow5_inv_split(FLOAT_POW5_INV_TABLE_SIZE, FLOAT_POW5_INV_BITCOUNT))
+print_table_64('FLOAT_POW5_SPLIT',
+    pow5_split(FLOAT_POW5_TABLE_SIZE, FLOAT_POW5_BITCOUNT))
@@ -0,0 +1,778 @@
+/* Fast conversion of numbers to and from text.
+ *
+ * Floating point numbers are formatted with the Ryu algorithm (Ulf Adams, "Ryu:
+ * fast float-to-string conversion", PLDI 2018), which computes the shortest
+ * decimal representation which round trips to the original value, choosing the
+ * closest such representation to the exact value.  Parsing uses Clinger's fast
+ * path for decimal numbers with few significant digits and falls back to the C
+ * library conversion otherwise. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <float.h>
+
+#include "error.h"
+
+#include "number_format.h"
+#include "ryu_tables.h"
+
+
+/* Pairs of decimal digits for all numbers from 0 to 99. */
+static const char DIGIT_TABLE[200] =
+    "00010203040506070809" "10111213141516171819"
+    "20212223242526272829" "30313233343536373839"
+    "40414243444546474849" "50515253545556575859"
+    "60616263646566676869" "70717273747576777879"
+    "80818283848586878889" "90919293949596979899";
+
+
+/* Writes the decimal digits of value to buffer with no leading zeros, returns
+ * the number of digits written.  The digits are generated two at a time from
+ * the least significant end. */
+static int write_digits(char buffer[], uint64_t value)
+{
+    char digits[20];
+    int index = 20;
+    while (value >= 100)
+    {
+        unsigned int pair = (unsigned int) (value % 100);
+        value /= 100;
+        index -= 2;
+        memcpy(&digits[index], &DIGIT_TABLE[2 * pair], 2);
+    }
+    if (value >= 10)
+    {
+        index -= 2;
+        memcpy(&digits[index], &DIGIT_TABLE[2 * value], 2);
+    }
+    else
+        digits[--index] = (char) ('0' + value);
+
+    int length = 20 - index;
+    memcpy(buffer, &digits[index], (size_t) length);
+    return length;
+}
+
+
+int format_int32(int32_t value, char buffer[])
+{
+    int length = 0;
+    uint32_t magnitude = (uint32_t) value;
+    if (value < 0)
+    {
+        buffer[length++] = '-';
+        magnitude = -magnitude;
+    }
+    length += write_digits(&buffer[length], magnitude);
+    buffer[length] = '\0';
+    return length;
+}
+
+
+/* Lays out the decimal value digits * 10^exponent in the same style as %g with
+ * a precision of 17, ie using exponential notation for very small or large
+ * numbers, returns the number of characters written. */
+static int layout_decimal(
+    char buffer[], bool negative, uint64_t mantissa, int exponent)
+{
+    char digits[20];
+    int length = write_digits(digits, mantissa);
+    /* Exponent of the first digit, as used for scientific notation. */
+    int sci_exponent = exponent + length - 1;
+
+    int index = 0;
+    if (negative)
+        buffer[index++] = '-';
+    if (sci_exponent < -4  ||  sci_exponent >= 17)
+    {
+        /* d.ddde+XX */
+        buffer[index++] = digits[0];
+        if (length > 1)
+        {
+            buffer[index++] = '.';
+            memcpy(&buffer[index], &digits[1], (size_t) length - 1);
+            index += length - 1;
+        }
+        buffer[index++] = 'e';
+        buffer[index++] = sci_exponent < 0 ? '-' : '+';
+        unsigned int exp_abs = (unsigned int) abs(sci_exponent);
+        if (exp_abs >= 100)
+        {
+            buffer[index++] = (char) ('0' + exp_abs / 100);
+            exp_abs %= 100;
+        }
+        memcpy(&buffer[index], &DIGIT_TABLE[2 * exp_abs], 2);
+        index += 2;
+    }
+    else if (exponent >= 0)
+    {
+        /* Integer: digits followed by exponent zeros. */
+        memcpy(&buffer[index], digits, (size_t) length);
+        index += length;
+        memset(&buffer[index], '0', (size_t) exponent);
+        index += exponent;
+    }
+    else if (sci_exponent >= 0)
+    {
+        /* Decimal point falls within digits. */
+        int integer = sci_exponent + 1;
+        memcpy(&buffer[index], digits, (size_t) integer);
+        index += integer;
+        buffer[index++] = '.';
+        memcpy(&buffer[index], &digits[integer], (size_t) (length - integer));
+        index += length - integer;
+    }
+    else
+    {
+        /* 0.000ddd */
+        buffer[index++] = '0';
+        buffer[index++] = '.';
+        memset(&buffer[index], '0', (size_t) (-sci_exponent - 1));
+        index += -sci_exponent - 1;
+        memcpy(&buffer[index], digits, (size_t) length);
+        index += length;
+    }
+    buffer[index] = '\0';
+    return index;
+}
+
+
+/* Formats infinities and NaN in a form that strtod will accept. */
+static int layout_special(char buffer[], bool negative, bool nan)
+{
+    const char *text =
+        nan ? "nan" : negative ? "-inf" : "inf";
+    strcpy(buffer, text);
+    return (int) strlen(text);
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Helper functions for Ryu. */
+
+/* Returns the number of bits in 5^e, valid for 0 <= e <= 3528. */
+static inline int pow5_bits(int e)
+{
+    return (int) (((uint32_t) e * 1217359) >> 19) + 1;
+}
+
+/* Returns floor(log10(2^e)), valid for 0 <= e <= 1650. */
+static inline int log10_pow2(int e)
+{
+    return (int) (((uint32_t) e * 78913) >> 18);
+}
+
+/* Returns floor(log10(5^e)), valid for 0 <= e <= 2620. */
+static inline int log10_pow5(int e)
+{
+    return (int) (((uint32_t) e * 732923) >> 20);
+}
+
+static inline unsigned int pow5_factor(uint64_t value)
+{
+    unsigned int count = 0;
+    while (value % 5 == 0)
+    {
+        value /= 5;
+        count += 1;
+    }
+    return count;
+}
+
+static inline bool multiple_of_pow5(uint64_t value, int p)
+{
+    return pow5_factor(value) >= (unsigned int) p;
+}
+
+static inline bool multiple_of_pow2(uint64_t value, int p)
+{
+    return (value & ((UINT64_C(1) << p) - 1)) == 0;
+}
+
+
+/* Computes (m * mul) >> j where mul is a 128 bit number and j >= 64.  Not all
+ * of our targets support 128 bit arithmetic, so we provide a portable
+ * fallback. */
+#ifdef __SIZEOF_INT128__
+static inline uint64_t mul_shift_64(
+    uint64_t m, const uint64_t mul[2], int j)
+{
+    unsigned __int128 b0 = (unsigned __int128) m * mul[0];
+    unsigned __int128 b2 = (unsigned __int128) m * mul[1];
+    return (uint64_t) (((b0 >> 64) + b2) >> (j - 64));
+}
+#else
+/* Returns the low 64 bits of a * b and the high 64 bits in *high. */
+static inline uint64_t umul128(uint64_t a, uint64_t b, uint64_t *high)
+{
+    uint32_t a_lo = (uint32_t) a;
+    uint32_t a_hi = (uint32_t) (a >> 32);
+    uint32_t b_lo = (uint32_t) b;
+    uint32_t b_hi = (uint32_t) (b >> 32);
+
+    uint64_t b00 = (uint64_t) a_lo * b_lo;
+    uint64_t b01 = (uint64_t) a_lo * b_hi;
+    uint64_t b10 = (uint64_t) a_hi * b_lo;
+    uint64_t b11 = (uint64_t) a_hi * b_hi;
+
+    uint64_t mid1 = b10 + (b00 >> 32);
+    uint64_t mid2 = b01 + (uint32_t) mid1;
+    *high = b11 + (mid1 >> 32) + (mid2 >> 32);
+    return (mid2 << 32) | (uint32_t) b00;
+}
+
+static inline uint64_t mul_shift_64(
+    uint64_t m, const uint64_t mul[2], int j)
+{
+    uint64_t high1;
+    uint64_t low1 = umul128(m, mul[1], &high1);
+    uint64_t high0;
+    umul128(m, mul[0], &high0);
+    uint64_t sum = high0 + low1;
+    if (sum < high0)
+        high1 += 1;
+    /* Shift right of 128 bit number (high1:sum) by 0 < j - 64 < 64 bits. */
+    int shift = j - 64;
+    return (high1 << (64 - shift)) | (sum >> shift);
+}
+#endif
+
+
+/* Computes (m * mul) >> j for a 64 bit multiplier. */
+static inline uint32_t mul_shift_32(uint32_t m, uint64_t mul, int j)
+{
+    uint64_t bits0 = (uint64_t) m * (uint32_t) mul;
+    uint64_t bits1 = (uint64_t) m * (uint32_t) (mul >> 32);
+    uint64_t sum = (bits0 >> 32) + bits1;
+    return (uint32_t) (sum >> (j - 32));
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Double formatting. */
+
+#define DOUBLE_MANTISSA_BITS    52
+#define DOUBLE_EXPONENT_BITS    11
+#define DOUBLE_BIAS             1023
+
+/* Computes the shortest decimal mantissa and exponent for the double with the
+ * given IEEE mantissa and exponent, which must be finite and non-zero. */
+static uint64_t shortest_double(
+    uint64_t ieee_mantissa, uint32_t ieee_exponent, int *exponent)
+{
+    int e2;
+    uint64_t m2;
+    if (ieee_exponent == 0)
+    {
+        e2 = 1 - DOUBLE_BIAS - DOUBLE_MANTISSA_BITS - 2;
+        m2 = ieee_mantissa;
+    }
+    else
+    {
+        e2 = (int) ieee_exponent - DOUBLE_BIAS - DOUBLE_MANTISSA_BITS - 2;
+        m2 = (UINT64_C(1) << DOUBLE_MANTISSA_BITS) | ieee_mantissa;
+    }
+    bool accept_bounds = (m2 & 1) == 0;
+
+    /* Step 2: determine the interval of valid decimal representations. */
+    uint64_t mv = 4 * m2;
+    uint64_t mm_shift = ieee_mantissa != 0  ||  ieee_exponent <= 1;
+
+    /* Step 3: convert to a decimal power base using 128 bit arithmetic. */
+    uint64_t vr, vp, vm;
+    int e10;
+    bool vm_is_trailing_zeros = false;
+    bool vr_is_trailing_zeros = false;
+    if (e2 >= 0)
+    {
+        int q = log10_pow2(e2) - (e2 > 3);
+        e10 = q;
+        int k = DOUBLE_POW5_INV_BITCOUNT + pow5_bits(q) - 1;
+        int i = -e2 + q + k;
+        vr = mul_shift_64(4 * m2, DOUBLE_POW5_INV_SPLIT[q], i);
+        vp = mul_shift_64(4 * m2 + 2, DOUBLE_POW5_INV_SPLIT[q], i);
+        vm = mul_shift_64(4 * m2 - 1 - mm_shift, DOUBLE_POW5_INV_SPLIT[q], i);
+        if (q <= 21)
+        {
+            /* Only one of mp, mv, and mm can be a multiple of 5, if any. */
+            if (mv % 5 == 0)
+                vr_is_trailing_zeros = multiple_of_pow5(mv, q);
+            else if (accept_bounds)
+                vm_is_trailing_zeros =
+                    multiple_of_pow5(mv - 1 - mm_shift, q);
+            else
+                vp -= multiple_of_pow5(mv + 2, q);
+        }
+    }
+    else
+    {
+        int q = log10_pow5(-e2) - (-e2 > 1);
+        e10 = q + e2;
+        int i = -e2 - q;
+        int k = pow5_bits(i) - DOUBLE_POW5_BITCOUNT;
+        int j = q - k;
+        vr = mul_shift_64(4 * m2, DOUBLE_POW5_SPLIT[i], j);
+        vp = mul_shift_64(4 * m2 + 2, DOUBLE_POW5_SPLIT[i], j);
+        vm = mul_shift_64(4 * m2 - 1 - mm_shift, DOUBLE_POW5_SPLIT[i], j);
+        if (q <= 1)
+        {
+            /* mv = 4 * m2 always has at least two trailing zero bits. */
+            vr_is_trailing_zeros = true;
+            if (accept_bounds)
+                vm_is_trailing_zeros = mm_shift == 1;
+            else
+                vp -= 1;
+        }
+        else if (q < 63)
+            vr_is_trailing_zeros = multiple_of_pow2(mv, q);
+    }
+
+    /* Step 4: find the shortest decimal representation in the interval. */
+    int removed = 0;
+    unsigned int last_removed_digit = 0;
+    uint64_t output;
+    if (vm_is_trailing_zeros  ||  vr_is_trailing_zeros)
+    {
+        /* General case, which happens rarely. */
+        while (vp / 10 > vm / 10)
+        {
+            vm_is_trailing_zeros &= vm % 10 == 0;
+            vr_is_trailing_zeros &= last_removed_digit == 0;
+            last_removed_digit = (unsigned int) (vr % 10);
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed += 1;
+        }
+        if (vm_is_trailing_zeros)
+            while (vm % 10 == 0)
+            {
+                vr_is_trailing_zeros &= last_removed_digit == 0;
+                last_removed_digit = (unsigned int) (vr % 10);
+                vr /= 10;
+                vp /= 10;
+                vm /= 10;
+                removed += 1;
+            }
+        /* Round even if the exact number is .....50..0. */
+        if (vr_is_trailing_zeros  &&  last_removed_digit == 5  &&  vr % 2 == 0)
+            last_removed_digit = 4;
+        output = vr + (
+            (vr == vm  &&  (!accept_bounds  ||  !vm_is_trailing_zeros))  ||
+            last_removed_digit >= 5);
+    }
+    else
+    {
+        /* Specialised for the common case, removing two digits at a time where
+         * possible. */
+        bool round_up = false;
+        if (vp / 100 > vm / 100)
+        {
+            round_up = vr % 100 >= 50;
+            vr /= 100;
+            vp /= 100;
+            vm /= 100;
+            removed += 2;
+        }
+        while (vp / 10 > vm / 10)
+        {
+            round_up = vr % 10 >= 5;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed += 1;
+        }
+        output = vr + (vr == vm  ||  round_up);
+    }
+    *exponent = e10 + removed;
+    return output;
+}
+
+
+int format_double(double value, char buffer[])
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(double));
+    bool negative = bits >> (DOUBLE_MANTISSA_BITS + DOUBLE_EXPONENT_BITS);
+    uint64_t ieee_mantissa = bits & ((UINT64_C(1) << DOUBLE_MANTISSA_BITS) - 1);
+    uint32_t ieee_exponent = (uint32_t) (
+        (bits >> DOUBLE_MANTISSA_BITS) & ((1u << DOUBLE_EXPONENT_BITS) - 1));
+
+    if (ieee_exponent == (1u << DOUBLE_EXPONENT_BITS) - 1)
+        return layout_special(buffer, negative, ieee_mantissa != 0);
+    else if (ieee_exponent == 0  &&  ieee_mantissa == 0)
+        return layout_decimal(buffer, negative, 0, 0);
+    else
+    {
+        int exponent;
+        uint64_t mantissa =
+            shortest_double(ieee_mantissa, ieee_exponent, &exponent);
+        return layout_decimal(buffer, negative, mantissa, exponent);
+    }
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Float formatting. */
+
+#define FLOAT_MANTISSA_BITS     23
+#define FLOAT_EXPONENT_BITS     8
+#define FLOAT_BIAS              127
+
+static inline uint32_t mul_pow5_inv_div_pow2(uint32_t m, int q, int j)
+{
+    return mul_shift_32(m, FLOAT_POW5_INV_SPLIT[q], j);
+}
+
+static inline uint32_t mul_pow5_div_pow2(uint32_t m, int i, int j)
+{
+    return mul_shift_32(m, FLOAT_POW5_SPLIT[i], j);
+}
+
+
+/* As for shortest_double, but for float with 32 bit arithmetic. */
+static uint32_t shortest_float(
+    uint32_t ieee_mantissa, uint32_t ieee_exponent, int *exponent)
+{
+    int e2;
+    uint32_t m2;
+    if (ieee_exponent == 0)
+    {
+        e2 = 1 - FLOAT_BIAS - FLOAT_MANTISSA_BITS - 2;
+        m2 = ieee_mantissa;
+    }
+    else
+    {
+        e2 = (int) ieee_exponent - FLOAT_BIAS - FLOAT_MANTISSA_BITS - 2;
+        m2 = (1u << FLOAT_MANTISSA_BITS) | ieee_mantissa;
+    }
+    bool accept_bounds = (m2 & 1) == 0;
+
+    uint32_t mv = 4 * m2;
+    uint32_t mp = 4 * m2 + 2;
+    uint32_t mm_shift = ieee_mantissa != 0  ||  ieee_exponent <= 1;
+    uint32_t mm = 4 * m2 - 1 - mm_shift;
+
+    uint32_t vr, vp, vm;
+    int e10;
+    bool vm_is_trailing_zeros = false;
+    bool vr_is_trailing_zeros = false;
+    unsigned int last_removed_digit = 0;
+    if (e2 >= 0)
+    {
+        int q = log10_pow2(e2);
+        e10 = q;
+        int k = FLOAT_POW5_INV_BITCOUNT + pow5_bits(q) - 1;
+        int i = -e2 + q + k;
+        vr = mul_pow5_inv_div_pow2(mv, q, i);
+        vp = mul_pow5_inv_div_pow2(mp, q, i);
+        vm = mul_pow5_inv_div_pow2(mm, q, i);
+        if (q != 0  &&  (vp - 1) / 10 <= vm / 10)
+        {
+            /* We need to know one removed digit even if we are not going to
+             * loop below. */
+            int l = FLOAT_POW5_INV_BITCOUNT + pow5_bits(q - 1) - 1;
+            last_removed_digit = mul_pow5_inv_div_pow2(
+                mv, q - 1, -e2 + q - 1 + l) % 10;
+        }
+        if (q <= 9)
+        {
+            if (mv % 5 == 0)
+                vr_is_trailing_zeros = multiple_of_pow5(mv, q);
+            else if (accept_bounds)
+                vm_is_trailing_zeros = multiple_of_pow5(mm, q);
+            else
+                vp -= multiple_of_pow5(mp, q);
+        }
+    }
+    else
+    {
+        int q = log10_pow5(-e2);
+        e10 = q + e2;
+        int i = -e2 - q;
+        int k = pow5_bits(i) - FLOAT_POW5_BITCOUNT;
+        int j = q - k;
+        vr = mul_pow5_div_pow2(mv, i, j);
+        vp = mul_pow5_div_pow2(mp, i, j);
+        vm = mul_pow5_div_pow2(mm, i, j);
+        if (q != 0  &&  (vp - 1) / 10 <= vm / 10)
+        {
+            j = q - 1 - (pow5_bits(i + 1) - FLOAT_POW5_BITCOUNT);
+            last_removed_digit = mul_pow5_div_pow2(mv, i + 1, j) % 10;
+        }
+        if (q <= 1)
+        {
+            vr_is_trailing_zeros = true;
+            if (accept_bounds)
+                vm_is_trailing_zeros = mm_shift == 1;
+            else
+                vp -= 1;
+        }
+        else if (q < 31)
+            vr_is_trailing_zeros = multiple_of_pow2(mv, q - 1);
+    }
+
+    int removed = 0;
+    uint32_t output;
+    if (vm_is_trailing_zeros  ||  vr_is_trailing_zeros)
+    {
+        while (vp / 10 > vm / 10)
+        {
+            vm_is_trailing_zeros &= vm % 10 == 0;
+            vr_is_trailing_zeros &= last_removed_digit == 0;
+            last_removed_digit = vr % 10;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed += 1;
+        }
+        if (vm_is_trailing_zeros)
+            while (vm % 10 == 0)
+            {
+                vr_is_trailing_zeros &= last_removed_digit == 0;
+                last_removed_digit = vr % 10;
+                vr /= 10;
+                vp /= 10;
+                vm /= 10;
+                removed += 1;
+            }
+        if (vr_is_trailing_zeros  &&  last_removed_digit == 5  &&  vr % 2 == 0)
+            last_removed_digit = 4;
+        output = vr + (
+            (vr == vm  &&  (!accept_bounds  ||  !vm_is_trailing_zeros))  ||
+            last_removed_digit >= 5);
+    }
+    else
+    {
+        while (vp / 10 > vm / 10)
+        {
+            last_removed_digit = vr % 10;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed += 1;
+        }
+        output = vr + (vr == vm  ||  last_removed_digit >= 5);
+    }
+    *exponent = e10 + removed;
+    return output;
+}
+
+
+int format_float(float value, char buffer[])
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(float));
+    bool negative = bits >> (FLOAT_MANTISSA_BITS + FLOAT_EXPONENT_BITS);
+    uint32_t ieee_mantissa = bits & ((1u << FLOAT_MANTISSA_BITS) - 1);
+    uint32_t ieee_exponent =
+        (bits >> FLOAT_MANTISSA_BITS) & ((1u << FLOAT_EXPONENT_BITS) - 1);
+
+    if (ieee_exponent == (1u << FLOAT_EXPONENT_BITS) - 1)
+        return layout_special(buffer, negative, ieee_mantissa != 0);
+    else if (ieee_exponent == 0  &&  ieee_mantissa == 0)
+        return layout_decimal(buffer, negative, 0, 0);
+    else
+    {
+        int exponent;
+        uint32_t mantissa =
+            shortest_float(ieee_mantissa, ieee_exponent, &exponent);
+        return layout_decimal(buffer, negative, mantissa, exponent);
+    }
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Parsing. */
+
+/* Decimal number of the form mantissa * 10^exponent. */
+struct decimal {
+    bool negative;
+    uint64_t mantissa;
+    int exponent;
+    const char *end;
+};
+
+/* At most 19 decimal digits are guaranteed to fit into 64 bits. */
+#define MAX_MANTISSA_DIGITS     19
+
+static inline bool is_digit(char ch)
+{
+    return '0' <= ch  &&  ch <= '9';
+}
+
+
+/* Parses a simple decimal number.  Returns false if the number has too many
+ * significant digits or isn't a plain decimal number (for example infinity,
+ * NaN, or a hexadecimal number), in which case the library conversion must be
+ * used. */
+static bool parse_decimal(const char *string, struct decimal *result)
+{
+    const char *p = string;
+    result->negative = *p == '-';
+    if (*p == '-'  ||  *p == '+')
+        p += 1;
+
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    bool seen_digit = false;
+
+    /* Leading zeros are not significant. */
+    while (*p == '0')
+    {
+        p += 1;
+        seen_digit = true;
+    }
+    for (; is_digit(*p); p ++)
+    {
+        if (digits++ >= MAX_MANTISSA_DIGITS)
+            return false;
+        mantissa = 10 * mantissa + (uint64_t) (*p - '0');
+        seen_digit = true;
+    }
+    if (*p == '.')
+    {
+        p += 1;
+        if (digits == 0)
+            for (; *p == '0'; p ++)
+            {
+                exponent -= 1;
+                seen_digit = true;
+            }
+        for (; is_digit(*p); p ++)
+        {
+            if (digits++ >= MAX_MANTISSA_DIGITS)
+                return false;
+            mantissa = 10 * mantissa + (uint64_t) (*p - '0');
+            exponent -= 1;
+            seen_digit = true;
+        }
+    }
+    if (!seen_digit  ||  *p == 'x'  ||  *p == 'X')
+        return false;
+
+    if (*p == 'e'  ||  *p == 'E')
+    {
+        const char *q = p + 1;
+        bool negative_exponent = *q == '-';
+        if (*q == '-'  ||  *q == '+')
+            q += 1;
+        /* An incomplete exponent is best left to the library. */
+        if (!is_digit(*q))
+            return false;
+        int value = 0;
+        for (; is_digit(*q); q ++)
+            if (value < 100000)
+                value = 10 * value + (*q - '0');
+        exponent += negative_exponent ? -value : value;
+        p = q;
+    }
+
+    result->mantissa = mantissa;
+    result->exponent = exponent;
+    result->end = p;
+    return true;
+}
+
+
+/* Powers of ten which are exactly representable as doubles. */
+static const double exact_double_powers[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+/* Powers of ten which are exactly representable as floats. */
+static const float exact_float_powers[] = {
+    1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f,
+};
+
+#define MAX_EXACT_DOUBLE        (UINT64_C(1) << 53)
+#define MAX_EXACT_FLOAT         (UINT64_C(1) << 24)
+
+
+/* Clinger's fast path: if both the mantissa and the power of ten are exactly
+ * representable then a single correctly rounded multiplication or division
+ * gives the correctly rounded result.  This relies on arithmetic being
+ * evaluated at the precision of the type, which is not true on x87. */
+static bool fast_double(const struct decimal *decimal, double *result)
+{
+    uint64_t mantissa = decimal->mantissa;
+    int exponent = decimal->exponent;
+    int max_power = (int) ARRAY_SIZE(exact_double_powers) - 1;
+
+    /* If the exponent is slightly too large we can move some of it into the
+     * mantissa if that remains exact. */
+    for (; exponent > max_power  &&  mantissa <= MAX_EXACT_DOUBLE / 10;
+         exponent --)
+        mantissa *= 10;
+
+    if (FLT_EVAL_METHOD != 0  ||  mantissa > MAX_EXACT_DOUBLE  ||
+        exponent < -max_power  ||  exponent > max_power)
+        return false;
+    else
+    {
+        double value = (double) mantissa;
+        if (exponent >= 0)
+            value *= exact_double_powers[exponent];
+        else
+            value /= exact_double_powers[-exponent];
+        *result = decimal->negative ? -value : value;
+        return true;
+    }
+}
+
+static bool fast_float(const struct decimal *decimal, float *result)
+{
+    uint64_t mantissa = decimal->mantissa;
+    int exponent = decimal->exponent;
+    int max_power = (int) ARRAY_SIZE(exact_float_powers) - 1;
+
+    if (FLT_EVAL_METHOD != 0  ||  mantissa > MAX_EXACT_FLOAT  ||
+        exponent < -max_power  ||  exponent > max_power)
+        return false;
+    else
+    {
+        float value = (float) mantissa;
+        if (exponent >= 0)
+            value *= exact_float_powers[exponent];
+        else
+            value /= exact_float_powers[-exponent];
+        *result = decimal->negative ? -value : value;
+        return true;
+    }
+}
+
+
+double parse_double(const char *string, char **end)
+{
+    struct decimal decimal;
+    double result;
+    if (parse_decimal(string, &decimal)  &&  fast_double(&decimal, &result))
+    {
+        if (end)
+            *end = CAST_FROM_TO(const char *, char *, decimal.end);
+        return result;
+    }
+    else
+        return strtod(string, end);
+}
+
+
+float parse_float(const char *string, char **end)
+{
+    struct decimal decimal;
+    float result;
+    if (parse_decimal(string, &decimal)  &&  fast_float(&decimal, &result))
+    {
+        if (end)
+            *end = CAST_FROM_TO(const char *, char *, decimal.end);
+        return result;
+    }
+    else
+        return strtof(string, end);
+}
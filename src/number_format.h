@@ -0,0 +1,21 @@
+/* Fast conversion of numbers to and from text. */
+
+/* Size of buffer required for formatting any of the supported numbers,
+ * including a trailing null. */
+#define FORMAT_NUMBER_SIZE      32
+
+/* Each of the following functions writes a null terminated string to buffer,
+ * which must be at least FORMAT_NUMBER_SIZE bytes long, and returns the number
+ * of characters written, not including the null.
+ *
+ * Floating point numbers are written with the shortest sequence of digits which
+ * converts back to the same value, using the same layout as printf("%g"). */
+int format_double(double value, char buffer[]);
+int format_float(float value, char buffer[]);
+int format_int32(int32_t value, char buffer[]);
+
+/* These are drop in replacements for strtod and strtof, exactly converting
+ * simple decimal numbers with few significant digits without resorting to the
+ * more expensive library conversion. */
+double parse_double(const char *string, char **end);
+float parse_float(const char *string, char **end);
@@ -6,28 +6,57 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <ctype.h>
+#include <inttypes.h>
 #include <errno.h>
 #include <time.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "error.h"
 #include "hashtable.h"
+#include "hashtable_typed.h"
+#include "number_format.h"
 
 #include "persistence_internal.h"
 #include "persistence.h"
 
 
 
-/* Used to store information about individual persistent variables. */
+/* Used to store information about individual persistent variables.  The saved
+ * copy is a snapshot of the variable taken under the domain mutex and then
+ * written to disk without holding the mutex. */
 struct persistent_variable {
     const struct persistent_action *action;
     const char *name;
     unsigned int max_length;
     unsigned int length;
+    bool dirty;                 // Set if changed since last snapshot
+    bool *dirty_chunks;         // Chunks of variable changed since snapshot
+    unsigned int chunk_count;
+    double max_latency;         // Longest time a change can remain unsaved
+    struct persistence_domain *domain;  // Domain owning this variable
+    unsigned int saved_length;  // Length of saved snapshot
+    char *saved;                // Snapshot of variable to be written to disk
+    bool journal;               // Saved snapshot not yet written to journal
+    bool reformat;              // Saved snapshot changed since text formatted
+    char *text;                 // Saved snapshot formatted as text
+    size_t text_length;
     char variable[0];
 };
 
 
+/* Large waveforms are compared, copied, and snapshot in chunks of this many
+ * bytes, so that writing an unchanged waveform only reads the stored copy, and
+ * a partial update only copies the chunks which actually changed. */
+#define CHUNK_SIZE          4096
+
+
 /* Used to implement core persistent actions, essentially converting values to
  * and from external strings. */
 struct persistent_action {
@@ -48,19 +77,26 @@ struct persistent_action {
 
 #define EPICS_STRING_LENGTH     40
 
+/* Numbers are formatted into a local buffer with the conversions from
+ * number_format.c which are considerably faster than fprintf, and floating
+ * point values are written with the fewest digits which will read back
+ * exactly. */
 #define DEFINE_WRITE(type, format) \
     static int write_##type(FILE *out, const void *variable) \
     { \
         type value; \
         memcpy(&value, variable, sizeof(type)); \
-        return fprintf(out, format, value); \
+        char buffer[FORMAT_NUMBER_SIZE]; \
+        int length = format(value, buffer); \
+        fwrite(buffer, 1, (size_t) length, out); \
+        return length; \
     }
 
-DEFINE_WRITE(int8_t,  "%d")
-DEFINE_WRITE(int16_t, "%d")
-DEFINE_WRITE(int32_t, "%d")
-DEFINE_WRITE(float,   "%.8g")
-DEFINE_WRITE(double,  "%.17g")
+DEFINE_WRITE(int8_t,  format_int32)
+DEFINE_WRITE(int16_t, format_int32)
+DEFINE_WRITE(int32_t, format_int32)
+DEFINE_WRITE(float,   format_float)
+DEFINE_WRITE(double,  format_double)
 
 
 static error__t check_number(const char *start, const char *end)
@@ -85,8 +121,8 @@ static error__t check_number(const char *start, const char *end)
 DEFINE_READ_NUM(int8_t, strtol, 10)
 DEFINE_READ_NUM(int16_t, strtol, 10)
 DEFINE_READ_NUM(int32_t, strtol, 10)
-DEFINE_READ_NUM(float, strtof)
-DEFINE_READ_NUM(double, strtod)
+DEFINE_READ_NUM(float, parse_float)
+DEFINE_READ_NUM(double, parse_double)
 
 
 static int write_bool(FILE *out, const void *variable)
@@ -187,28 +223,296 @@ static const struct persistent_action persistent_actions[] = {
 
 /******************************************************************************/
 
-/* Lookup table of persistent variables. */
-static struct hash_table *variable_table;
-/* Flag set if persistent state needs to be written to disk. */
-static bool persistence_dirty = false;
-/* Persistence loaded from and written to this file. */
-static const char *state_filename = NULL;
-/* How long to wait between persistence wakeups. */
-static int persistence_interval;
+/* Persistent variables indexed by name.  We look after name lifetime. */
+DEFINE_HASH_TABLE(variable_table,
+    const char *, struct persistent_variable *,
+    hash_string_key, compare_string_key)
+
+
+/* Persistent variables are grouped into domains, each with its own state file,
+ * save interval, locks, and writer thread, so that saving one domain neither
+ * rewrites nor blocks the variables of any other.  Variables are assigned to
+ * domains by name prefix, the default domain holds all other variables and is
+ * saved to the state file named by load_persistent_state(). */
+struct persistence_domain {
+    const char *prefix;         // Name prefix, NULL for default domain
+    struct variable_table *variable_table;  // Variables in this domain
+    /* Flag set if persistent state needs to be written to disk. */
+    bool persistence_dirty;
+    /* Set if the state file must be rewritten in full on the next save. */
+    bool rewrite_state;
+    /* Persistence loaded from and written to this file. */
+    char *state_filename;
+    /* In journal mode changes are appended to this file, which is folded into
+     * the state file when it grows larger than journal_limit. */
+    char *journal_filename;
+    FILE *journal_file;
+    size_t journal_limit;
+    /* Default for the longest time a change can remain unsaved. */
+    int persistence_interval;
+    /* If set, each change defers saving by this many seconds. */
+    double save_debounce;
+    /* Format used when writing the state file. */
+    enum persistence_format persistence_format;
+
+    /* To ensure state is updated in a timely way we have a background thread
+     * responsible for this.  The mutex guards the variables and is only held
+     * while taking a snapshot of state, the separate save_mutex serialises
+     * writing the state file and guards the saved snapshots.  If both are
+     * needed save_mutex must be taken first. */
+    pthread_mutex_t mutex;
+    pthread_mutex_t save_mutex;
+    pthread_cond_t psignal;
+    /* Used to signal thread termination. */
+    bool thread_running;
+    /* Thread handle used for shutdown. */
+    pthread_t persistence_thread_id;
+
+    /* A save is scheduled when state first becomes dirty.  Saving is due at
+     * save_deadline, which can be deferred by debouncing but never beyond
+     * save_latest, the earliest latency deadline of any unsaved change. */
+    bool save_scheduled;
+    struct timespec save_deadline;
+    struct timespec save_latest;
+
+    /* Running totals for get_persistence_stats(), so that gathering statistics
+     * doesn't hold the mutex while walking the variables.  dirty_count counts
+     * the variables with dirty set. */
+    unsigned int variable_count;
+    size_t variable_bytes;
+    unsigned int dirty_count;
+
+    /* Time spent by record threads waiting for the domain mutex. */
+    uint64_t lock_waits;
+    double lock_wait_time;
+    double max_lock_wait;
+
+    struct persistence_domain *next;
+};
+
+#define DOMAIN_INITIALISER { \
+    .mutex = PTHREAD_MUTEX_INITIALIZER, \
+    .save_mutex = PTHREAD_MUTEX_INITIALIZER, \
+    .psignal = PTHREAD_COND_INITIALIZER, \
+    .thread_running = true, \
+}
+
+/* The default domain is always present and is the last domain in the list,
+ * domains added later are placed at the front.  Settings made before a domain
+ * is added are copied from the default domain. */
+static struct persistence_domain default_domain = DOMAIN_INITIALISER;
+static struct persistence_domain *domains = &default_domain;
+
+#define FOR_EACH_DOMAIN(domain) \
+    for (struct persistence_domain *domain = domains; domain; \
+         domain = domain->next)
+
+/* Lookup table of all persistent variables.  This, the list of domains, and
+ * the list of latency classes are guarded by domains_mutex, which must be taken
+ * before any domain mutex, and domain mutexes must be taken in list order. */
+static struct variable_table *variable_table;
+static pthread_mutex_t domains_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Set once load_persistent_state() has been called. */
+static bool state_loaded = false;
+
+/* Statistics on saving and loading, guarded by stats_mutex. */
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int save_count;
+static double last_save_time;
+static size_t last_save_bytes;
+static uint64_t bytes_written;
+static double load_time;
+
+/* Variables with names matching a prefix can be given their own maximum save
+ * latency, the most recently added matching class applies. */
+struct latency_class {
+    char *prefix;
+    double max_latency;
+    struct latency_class *next;
+};
+static struct latency_class *latency_classes = NULL;
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Save scheduling. */
+
+#define NSECS   1000000000
+
+/* Adds a non-negative interval in seconds to the given time. */
+static struct timespec add_seconds(struct timespec time, double seconds)
+{
+    time_t whole_seconds = (time_t) seconds;
+    time.tv_sec += whole_seconds;
+    time.tv_nsec += (long) (NSECS * (seconds - (double) whole_seconds));
+    if (time.tv_nsec >= NSECS)
+    {
+        time.tv_nsec -= NSECS;
+        time.tv_sec += 1;
+    }
+    return time;
+}
+
+static double monotonic_seconds(void)
+{
+    struct timespec now;
+    ASSERT_IO(clock_gettime(CLOCK_MONOTONIC, &now));
+    return (double) now.tv_sec + 1e-9 * (double) now.tv_nsec;
+}
+
+
+static bool time_before(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec < b->tv_sec  ||
+        (a->tv_sec == b->tv_sec  &&  a->tv_nsec < b->tv_nsec);
+}
+
+
+/* Marks the domain state file as needing to be written within max_latency
+ * seconds.  The persistence thread is only woken if this brings the save
+ * forward.  Must be called with the domain mutex held. */
+static void schedule_save(
+    struct persistence_domain *domain, double max_latency)
+{
+    struct timespec now;
+    ASSERT_IO(clock_gettime(CLOCK_REALTIME, &now));
+    struct timespec latest = add_seconds(now, max_latency);
+    if (!domain->save_scheduled  ||  time_before(&latest, &domain->save_latest))
+        domain->save_latest = latest;
+
+    struct timespec deadline = domain->save_latest;
+    if (domain->save_debounce > 0)
+    {
+        struct timespec debounce = add_seconds(now, domain->save_debounce);
+        if (time_before(&debounce, &deadline))
+            deadline = debounce;
+    }
+
+    bool wake = !domain->save_scheduled  ||
+        time_before(&deadline, &domain->save_deadline);
+    domain->save_deadline = deadline;
+    domain->save_scheduled = true;
+    domain->persistence_dirty = true;
+    if (wake)
+        pthread_cond_signal(&domain->psignal);
+}
+
+
+/* Schedules a save of the domain at its default interval. */
+static void schedule_domain_save(struct persistence_domain *domain)
+{
+    schedule_save(domain, domain->persistence_interval);
+}
+
+
+static double variable_latency(const struct persistent_variable *persistence)
+{
+    return persistence->max_latency > 0 ?
+        persistence->max_latency : persistence->domain->persistence_interval;
+}
+
+
+/* A prefix matches the start of the variable name, or the start of the PV name
+ * following the record type. */
+static bool match_name_prefix(const char *name, const char *prefix)
+{
+    size_t length = strlen(prefix);
+    const char *colon = strchr(name, ':');
+    return strncmp(name, prefix, length) == 0  ||
+        (colon  &&  strncmp(colon + 1, prefix, length) == 0);
+}
+
+
+static double lookup_latency_class(const char *name)
+{
+    for (struct latency_class *class = latency_classes; class;
+         class = class->next)
+        if (match_name_prefix(name, class->prefix))
+            return class->max_latency;
+    return 0;
+}
+
+
+/* Returns the domain owning variables with the given name. */
+static struct persistence_domain *lookup_domain(const char *name)
+{
+    FOR_EACH_DOMAIN(domain)
+        if (domain->prefix  &&  match_name_prefix(name, domain->prefix))
+            return domain;
+    return &default_domain;
+}
+
+
+/* Takes the domain mutex on behalf of a record thread.  If the mutex is busy,
+ * typically because a snapshot is being taken, the time spent waiting for it
+ * is recorded. */
+static void lock_domain(struct persistence_domain *domain)
+{
+    if (pthread_mutex_trylock(&domain->mutex) != 0)
+    {
+        double start = monotonic_seconds();
+        ASSERT_PTHREAD(pthread_mutex_lock(&domain->mutex));
+        double wait = monotonic_seconds() - start;
+        domain->lock_waits += 1;
+        domain->lock_wait_time += wait;
+        domain->max_lock_wait = MAX(domain->max_lock_wait, wait);
+    }
+}
+
+#define WITH_DOMAIN_LOCK(domain) \
+    _WITH_ENTER_LEAVE( \
+        lock_domain(domain), pthread_mutex_unlock(&(domain)->mutex))
+
+
+static size_t variable_size(const struct persistent_variable *persistence)
+{
+    return persistence->max_length * persistence->action->size;
+}
+
 
-/* To ensure state is updated in a timely way we have a background thread
- * responsible for this. */
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t psignal = PTHREAD_COND_INITIALIZER;
-/* Used to signal thread termination. */
-static bool thread_running = true;
-/* Thread handle used for shutdown. */
-static pthread_t persistence_thread_id;
+/* Adds a variable to the domain and its running totals.  Called with the domain
+ * mutex held. */
+static void add_domain_variable(
+    struct persistence_domain *domain, struct persistent_variable *persistence)
+{
+    variable_table_insert(
+        domain->variable_table, persistence->name, persistence);
+    domain->variable_count += 1;
+    domain->variable_bytes += variable_size(persistence);
+    if (persistence->dirty)
+        domain->dirty_count += 1;
+}
+
+
+/* Removes a variable from the domain and its running totals.  Called with the
+ * domain mutex held. */
+static void remove_domain_variable(
+    struct persistence_domain *domain, struct persistent_variable *persistence)
+{
+    variable_table_delete(domain->variable_table, persistence->name);
+    domain->variable_count -= 1;
+    domain->variable_bytes -= variable_size(persistence);
+    if (persistence->dirty)
+        domain->dirty_count -= 1;
+}
 
 
+/* Sets the dirty flag of a variable, counting it in its domain.  Called with
+ * the domain mutex held, but text state files are parsed by several threads
+ * at once so the count is updated atomically. */
+static void set_variable_dirty(struct persistent_variable *persistence)
+{
+    if (!persistence->dirty)
+    {
+        persistence->dirty = true;
+        __atomic_fetch_add(
+            &persistence->domain->dirty_count, 1, __ATOMIC_RELAXED);
+    }
+}
+
 
 /* Creates new persistent variable. */
-void create_persistent_waveform(
+struct persistent_variable *create_persistent_waveform(
     const char *name, enum PERSISTENCE_TYPES type, unsigned int max_length)
 {
     /* If you try to create a persistent PV without having first initialised the
@@ -222,31 +526,38 @@ void create_persistent_waveform(
     persistence->name = strdup(name);
     persistence->max_length = max_length;
     persistence->length = 0;
-
-    WITH_MUTEX(mutex)
-        hash_table_insert(variable_table, persistence->name, persistence);
-}
-
-
-static struct persistent_variable *lookup_persistence(const char *name)
-{
-    struct persistent_variable *persistence =
-        hash_table_lookup(variable_table, name);
-    error_report(TEST_OK_(persistence,
-        "Persistent variable %s not found", name));
+    persistence->dirty = false;
+    persistence->chunk_count =
+        (max_length * action->size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    persistence->dirty_chunks = calloc(persistence->chunk_count, sizeof(bool));
+    persistence->saved_length = 0;
+    persistence->saved = malloc(max_length * action->size);
+    persistence->journal = false;
+    persistence->reformat = false;
+    persistence->text = NULL;
+    persistence->text_length = 0;
+
+    WITH_MUTEX(domains_mutex)
+    {
+        persistence->max_latency = lookup_latency_class(name);
+        persistence->domain = lookup_domain(name);
+        variable_table_insert(variable_table, persistence->name, persistence);
+        WITH_MUTEX(persistence->domain->mutex)
+            add_domain_variable(persistence->domain, persistence);
+    }
     return persistence;
 }
 
 
 /* Updates variable from value stored on disk. */
 bool read_persistent_waveform(
-    const char *name, void *variable, unsigned int *length)
+    struct persistent_variable *persistence,
+    void *variable, unsigned int *length)
 {
     bool ok;
-    WITH_MUTEX(mutex)
+    WITH_DOMAIN_LOCK(persistence->domain)
     {
-        struct persistent_variable *persistence = lookup_persistence(name);
-        ok = persistence != NULL  &&  persistence->length > 0;
+        ok = persistence->length > 0;
         if (ok)
         {
             memcpy(variable, persistence->variable,
@@ -257,225 +568,665 @@ bool read_persistent_waveform(
     return ok;
 }
 
-bool read_persistent_variable(const char *name, void *variable)
+bool read_persistent_variable(
+    struct persistent_variable *persistence, void *variable)
 {
     unsigned int length;
-    bool ok = read_persistent_waveform(name, variable, &length);
+    bool ok = read_persistent_waveform(persistence, variable, &length);
     if (ok)
         ASSERT_OK(length == 1);
     return ok;
 }
 
 
+/* Marks the entire variable as changed, used when it is loaded as a whole. */
+static void mark_variable_dirty(struct persistent_variable *persistence)
+{
+    set_variable_dirty(persistence);
+    memset(persistence->dirty_chunks, true,
+        persistence->chunk_count * sizeof(bool));
+}
+
+
+/* Compares the new value with the stored variable a chunk at a time, copying
+ * and marking only the chunks which differ.  Any part of the new value beyond
+ * the old length is always copied.  Returns true if anything has changed. */
+static bool update_chunks(
+    struct persistent_variable *persistence,
+    const void *value, unsigned int length)
+{
+    size_t old_size = persistence->length * persistence->action->size;
+    size_t new_size = length * persistence->action->size;
+    bool changed = persistence->length != length;
+    unsigned int chunk = 0;
+    for (size_t offset = 0; offset < new_size; offset += CHUNK_SIZE, chunk ++)
+    {
+        size_t count = MIN((size_t) CHUNK_SIZE, new_size - offset);
+        if (offset + count > old_size  ||
+            memcmp(persistence->variable + offset, value + offset, count))
+        {
+            memcpy(persistence->variable + offset, value + offset, count);
+            persistence->dirty_chunks[chunk] = true;
+            changed = true;
+        }
+    }
+    persistence->length = length;
+    return changed;
+}
+
+
 /* Writes value to persistent variable. */
 void write_persistent_waveform(
-    const char *name, const void *value, unsigned int length)
+    struct persistent_variable *persistence,
+    const void *value, unsigned int length)
 {
-    WITH_MUTEX(mutex)
+    WITH_DOMAIN_LOCK(persistence->domain)
     {
-        struct persistent_variable *persistence = lookup_persistence(name);
-        if (persistence != NULL)
+        /* Don't force a write of the persistence file if nothing has actually
+         * changed. */
+        if (update_chunks(persistence, value, length))
         {
-            /* Don't force a write of the persistence file if nothing has
-             * actually changed. */
-            unsigned int size = length * persistence->action->size;
-            persistence_dirty =
-                persistence_dirty  ||
-                persistence->length != length  ||
-                memcmp(persistence->variable, value, size);
-
-            persistence->length = length;
-            memcpy(persistence->variable, value, size);
+            set_variable_dirty(persistence);
+            schedule_save(persistence->domain, variable_latency(persistence));
         }
     }
 }
 
-void write_persistent_variable(const char *name, const void *value)
+void write_persistent_variable(
+    struct persistent_variable *persistence, const void *value)
 {
-    write_persistent_waveform(name, value, 1);
+    write_persistent_waveform(persistence, value, 1);
 }
 
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Reading state file. */
 
-#define READ_BUFFER_SIZE    1024
+/* Looks up a variable named in the state file of the given domain, or in an
+ * imported file if domain is NULL.  Variables belonging to another domain are
+ * loaded all the same, which allows variables to be moved between domains, but
+ * then both state files must be rewritten.  Called with domains_mutex and all
+ * domain mutexes held. */
+static struct persistent_variable *lookup_variable(
+    struct persistence_domain *domain, const char *name)
+{
+    struct persistent_variable *persistence =
+        variable_table_lookup(variable_table, name);
+    if (persistence  &&  persistence->domain != domain)
+    {
+        persistence->domain->rewrite_state = true;
+        if (domain)
+            domain->rewrite_state = true;
+    }
+    return persistence;
+}
+
+
+/* The text state file is mapped into memory and divided into blocks, each
+ * block being a single <key>=<value> assignment together with its continuation
+ * lines.  As each block updates a separate variable the blocks can be parsed in
+ * parallel, which matters when loading large waveforms. */
+
+/* Files smaller than this are always parsed on the calling thread. */
+#define PARALLEL_PARSE_SIZE     (1 << 16)
+/* Limits the number of parsing threads. */
+#define MAX_PARSE_THREADS       16
+
+struct text_block {
+    const char *start;          // Start of first line
+    const char *end;            // Just past newline ending last line
+    const char *value;          // Start of value following =
+    int line_number;            // Line number of first line
+    int last_line;              // Line number of last continuation line
+    struct persistent_variable *persistence;
+    struct text_block *next;    // Later assignment to the same variable
+    bool chained;               // Set if parsed as part of an earlier block
+    error__t error;
+    int error_line;             // Line on which error was detected
+};
 
-struct line_buffer {
-    FILE *file;
-    int line_number;
-    char line[READ_BUFFER_SIZE];
+struct text_parse {
+    struct text_block **work;   // Blocks to parse, largest first
+    size_t work_count;
+    size_t next_work;           // Index of next block to claim
+    pthread_mutex_t mutex;
 };
 
 
-/* Reads one line into the line buffer, returning false if an error is detected
- * and setting *eof accordingly.  Also ensures that we've read a complete
- * newline terminated line.  This will also fail if the input file doesn't end
- * with a newline.  The terminating newline character is then deleted. */
-static error__t read_line(struct line_buffer *line, bool *eof)
+/* Skips spaces before the next value and follows any line continuation.  Note
+ * that we're careful never to move past the newline ending the last line of the
+ * block, as the following block may be in the hands of another thread. */
+static error__t skip_to_value(
+    const struct text_block *block, const char **cursor, int *line_number)
 {
-    errno = 0;
-    *eof = fgets(line->line, READ_BUFFER_SIZE, line->file) == NULL;
-    if (*eof)
-        return TEST_OK_(errno == 0, "Error reading state file");
-    else
+    while (**cursor == ' ')
+        *cursor += 1;
+    error__t error = ERROR_OK;
+    if ((*cursor)[0] == '\\'  &&  (*cursor)[1] == '\n')
     {
-        size_t len = strlen(line->line);
-        line->line_number += 1;
-        return
-            TEST_OK_(len > 0  &&  line->line[len - 1] == '\n',
-                "Line %d truncated?", line->line_number)  ?:
-            DO(line->line[len - 1] = '\0');
+        *cursor += 2;
+        *line_number += 1;
+        error = TEST_OK_(*cursor < block->end,
+            "End of file after line continuation");
+        while (**cursor == ' ')
+            *cursor += 1;
     }
+    /* The number parsers skip all whitespace, including newlines and carriage
+     * returns, and so could run past the end of the block. */
+    return error  ?:
+        TEST_OK_(!isspace((unsigned char) **cursor), "Missing value");
 }
 
 
-/* Skips leading whitespace and refills the line buffer if a line continuation
- * character is encountered. */
-static error__t fill_line_buffer(struct line_buffer *line, const char **cursor)
+/* Parses the value part of a block into its variable. */
+static void parse_block_value(struct text_block *block)
 {
-    while (**cursor == ' ')
-        *cursor += 1;
+    struct persistent_variable *persistence = block->persistence;
+    const char *cursor = block->value;
+    int line_number = block->line_number;
+    void *variable = persistence->variable;
+    unsigned int size = persistence->action->size;
+    unsigned int length = 0;
     error__t error = ERROR_OK;
-    if (**cursor == '\\')
+    for (; !error  &&  *cursor != '\n'  &&  length < persistence->max_length;
+         length ++)
     {
-        bool eof;
-        error = read_line(line, &eof)  ?:
-            TEST_OK_(!eof, "End of file after line continuation");
-        if (!error)
-        {
-            *cursor = line->line;
-            while (**cursor == ' ')
-                *cursor += 1;
-        }
+        error = skip_to_value(block, &cursor, &line_number)  ?:
+            persistence->action->read(&cursor, variable);
+        variable += size;
     }
-    return error;
+    persistence->length = error ? 0 : length;
+    mark_variable_dirty(persistence);
+    block->error = error  ?:
+        TEST_OK_(*cursor == '\n', "Unexpected extra characters");
+    block->error_line = line_number;
 }
 
 
-/* Flushes any trailing continuation lines. */
-static void flush_continuation(struct line_buffer *line)
+/* Parses a block and any later assignments to the same variable, in order. */
+static void parse_block_chain(struct text_block *block)
 {
-    size_t line_len;
-    error__t error = ERROR_OK;
-    bool discard = false;
-    int first_line = 0, last_line = 0;
-    while (
-        line_len = strlen(line->line),
-        !error  &&  line_len > 0  &&  line->line[line_len - 1] == '\\')
+    for (; block; block = block->next)
+        parse_block_value(block);
+}
+
+
+static void *parse_blocks_thread(void *context)
+{
+    struct text_parse *parse = context;
+    while (true)
+    {
+        struct text_block *block = NULL;
+        WITH_MUTEX(parse->mutex)
+            if (parse->next_work < parse->work_count)
+                block = parse->work[parse->next_work++];
+        if (!block)
+            break;
+        parse_block_chain(block);
+    }
+    return NULL;
+}
+
+
+/* Largest blocks first so that one large waveform at the end of the file
+ * doesn't leave all the other threads idle. */
+static int compare_block_size(const void *a, const void *b)
+{
+    const struct text_block *block_a = *(struct text_block *const *) a;
+    const struct text_block *block_b = *(struct text_block *const *) b;
+    size_t size_a = (size_t) (block_a->end - block_a->start);
+    size_t size_b = (size_t) (block_b->end - block_b->start);
+    return (size_a < size_b) - (size_a > size_b);
+}
+
+
+/* Parses all blocks with looked up variables, using a pool of threads if the
+ * file is large enough to make this worthwhile. */
+static void parse_blocks(
+    struct text_block blocks[], size_t count, size_t file_size)
+{
+    struct text_parse parse = {
+        .work = calloc(count, sizeof(struct text_block *)),
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+    };
+    for (size_t i = 0; i < count; i ++)
+        if (blocks[i].persistence  &&  !blocks[i].chained)
+            parse.work[parse.work_count++] = &blocks[i];
+
+    size_t thread_count = 0;
+    pthread_t threads[MAX_PARSE_THREADS];
+    if (file_size >= PARALLEL_PARSE_SIZE  &&  parse.work_count > 1)
+    {
+        qsort(parse.work, parse.work_count, sizeof(struct text_block *),
+            compare_block_size);
+
+        /* The calling thread also takes part in parsing. */
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        size_t wanted = MIN(parse.work_count, (size_t) MAX(cpus, 1L)) - 1;
+        wanted = MIN(wanted, (size_t) MAX_PARSE_THREADS);
+        while (thread_count < wanted  &&
+               pthread_create(&threads[thread_count], NULL,
+                   parse_blocks_thread, &parse) == 0)
+            thread_count += 1;
+    }
+
+    parse_blocks_thread(&parse);
+    for (size_t i = 0; i < thread_count; i ++)
+        pthread_join(threads[i], NULL);
+    free(parse.work);
+}
+
+
+/* Looks up the variable assigned by a block. */
+static void lookup_block_key(
+    struct persistence_domain *domain, struct text_block *block)
+{
+    const char *newline = memchr(
+        block->start, '\n', (size_t) (block->end - block->start));
+    const char *equal = memchr(
+        block->start, '=', (size_t) (newline - block->start));
+    error__t error = TEST_OK_(equal, "Missing =");
+    if (!error)
+    {
+        char *key = strndup(block->start, (size_t) (equal - block->start));
+        block->value = equal + 1;
+        error = TEST_OK_(
+            block->persistence = lookup_variable(domain, key),
+            "Persistence key \"%s\" not found", key);
+        free(key);
+    }
+    block->error = error;
+    block->error_line = block->line_number;
+}
+
+
+/* Divides the mapped file into assignment blocks, skipping comments and blank
+ * lines, and looks up the variable for each block.  Blocks assigning a variable
+ * already assigned by an earlier block are chained onto the earlier block so
+ * that assignments are applied in file order.  If the file doesn't end with a
+ * newline the last line was torn by a crash while appending to the journal, so
+ * it is discarded with a warning: state files are renamed into place only
+ * once complete.  The fragment must not be left for the next journal append to
+ * extend, so the state file is rewritten on the next save. */
+static void split_text_blocks(
+    struct persistence_domain *domain, const char *map, size_t size,
+    const char *filename, struct text_block **blocks, size_t *count)
+{
+    size_t max_count = 16;
+    *blocks = malloc(max_count * sizeof(struct text_block));
+    *count = 0;
+    struct hash_table *last_blocks = hash_table_create_ptrs();
+
+    const char *end = map + size;
+    const char *line = map;
+    int line_number = 0;
+    bool truncated = false;
+    while (!truncated  &&  line < end)
     {
-        bool eof;
-        error = read_line(line, &eof)  ?:
-            TEST_OK_(!eof, "End of file after line continuation");
+        struct text_block block = {
+            .start = line,
+            .line_number = line_number + 1,
+        };
+        /* Gather the line and all its continuation lines.  Comments are
+         * never continued. */
+        bool comment = *line == '#';
+        bool continuation = true;
+        while (!truncated  &&  continuation  &&  line < end)
+        {
+            const char *newline = memchr(line, '\n', (size_t) (end - line));
+            line_number += 1;
+            truncated = newline == NULL;
+            if (truncated)
+            {
+                printf("Discarding truncated line %d of state file %s\n",
+                    line_number, filename);
+                if (domain)
+                    domain->rewrite_state = true;
+            }
+            else
+            {
+                continuation =
+                    !comment  &&  newline > line  &&  newline[-1] == '\\';
+                line = newline + 1;
+            }
+        }
+        block.end = line;
+        block.last_line = line_number;
+
+        /* Skip lines beginning with # and blank lines. */
+        if (truncated  ||  comment  ||  *block.start == '\n')
+            continue;
 
-        /* Record discard parameters so we can make one report when done. */
-        if (!discard)
+        lookup_block_key(domain, &block);
+        if (*count >= max_count)
         {
-            discard = true;
-            first_line = line->line_number;
+            max_count *= 2;
+            *blocks = realloc(*blocks, max_count * sizeof(struct text_block));
         }
-        last_line = line->line_number;
+        (*blocks)[(*count)++] = block;
     }
-    error_report(error);
 
-    if (discard)
+    /* Now that the block array is stable we can link the chains. */
+    for (size_t i = 0; i < *count; i ++)
     {
-        if (first_line == last_line)
-            printf("Discarding line %d\n", first_line);
-        else
-            printf("Discarding lines %d-%d\n", first_line, last_line);
+        struct text_block *block = &(*blocks)[i];
+        if (block->persistence)
+        {
+            struct text_block *last =
+                hash_table_insert(last_blocks, block->persistence, block);
+            block->chained = last != NULL;
+            if (last)
+                last->next = block;
+        }
     }
+    hash_table_destroy(last_blocks);
 }
 
 
-/* Parses the right hand side of a <key>=<value> assignment, taking into account
- * the possibility that the value can extend over multiple lines.  A final \ is
- * used to flag line continuation. */
-static error__t parse_value(
-    struct line_buffer *line, const char *cursor,
-    struct persistent_variable *persistence)
+/* Reports the location of a block parsing error and the lines discarded. */
+static void extend_block_error(
+    const struct text_block *block, const char *filename)
 {
-    void *variable = persistence->variable;
-    unsigned int size = persistence->action->size;
-    unsigned int length = 0;
-    error__t error = ERROR_OK;
-    for (; !error  &&  *cursor != '\0'  &&  length < persistence->max_length;
-         length ++)
+    error_extend(block->error,
+        "Error parsing %s on line %d of state file %s",
+        block->persistence ? block->persistence->name : "(unknown)",
+        block->error_line, filename);
+    if (block->error_line == block->last_line - 1)
+        printf("Discarding line %d\n", block->last_line);
+    else if (block->error_line < block->last_line)
+        printf("Discarding lines %d-%d\n",
+            block->error_line + 1, block->last_line);
+}
+
+
+static error__t parse_text_map(
+    struct persistence_domain *domain,
+    const char *map, size_t size, const char *filename, bool check_parse)
+{
+    struct text_block *blocks;
+    size_t count;
+    split_text_blocks(domain, map, size, filename, &blocks, &count);
+    parse_blocks(blocks, count, size);
+
+    /* Although block parsing can fail, we only report errors if check_parse
+     * is not set.  This means that we will complete the loading of a broken
+     * state file (for example, if keys have changed), error messages will be
+     * printed, but this function will succeed.  If check_parse is set we
+     * return the first error in file order. */
+    error__t parse_error = ERROR_OK;
+    for (size_t i = 0; i < count; i ++)
     {
-        error = fill_line_buffer(line, &cursor)  ?:
-            persistence->action->read(&cursor, variable);
-        variable += size;
+        struct text_block *block = &blocks[i];
+        if (block->error)
+        {
+            extend_block_error(block, filename);
+            if (check_parse  &&  !parse_error)
+                parse_error = block->error;
+            else if (check_parse)
+                error_discard(block->error);
+            else
+                error_report(block->error);
+        }
     }
-    persistence->length = error ? 0 : length;
+    free(blocks);
+    return parse_error;
+}
+
+
+/* Maps the whole of the given file into memory, an empty file is returned as a
+ * NULL map. */
+static error__t map_state_file(
+    FILE *file, const char *filename, void **map, size_t *size)
+{
+    struct stat st;
+    *map = NULL;
     return
-        error  ?:
-        TEST_OK_(*cursor == '\0', "Unexpected extra characters");
+        TEST_IO_(fstat(fileno(file), &st),
+            "Unable to stat state file %s", filename)  ?:
+        DO(*size = (size_t) st.st_size)  ?:
+        IF(*size > 0,
+            TEST_OK_IO_((*map = mmap(
+                NULL, *size, PROT_READ, MAP_PRIVATE, fileno(file), 0))
+                    != MAP_FAILED,
+                "Unable to map state file %s", filename));
+}
+
+
+static error__t parse_text_file(
+    struct persistence_domain *domain,
+    FILE *file, const char *filename, bool check_parse)
+{
+    void *map;
+    size_t size;
+    return
+        map_state_file(file, filename, &map, &size)  ?:
+        IF(map,
+            DO_FINALLY(
+                parse_text_map(domain, map, size, filename, check_parse),
+                munmap(map, size)));
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Binary state file. */
+
+/* The binary state file consists of a header, an index with one entry for each
+ * stored variable, a table of null terminated variable names, and finally the
+ * raw variable values, each aligned to an 8 byte boundary.  All values are
+ * stored in native byte order and all offsets are from the start of the file,
+ * so a state file can be loaded directly from a memory mapping. */
+
+#define BINARY_MAGIC        "EPDSTATE"
+#define BINARY_VERSION      1
+#define BINARY_BYTE_ORDER   0x01020304
+#define BINARY_ALIGN(size)  (((size) + 7) & ~(size_t) 7)
+
+struct binary_header {
+    char magic[8];              // BINARY_MAGIC, without null terminator
+    uint32_t version;           // BINARY_VERSION
+    uint32_t byte_order;        // BINARY_BYTE_ORDER in writer's byte order
+    uint32_t count;             // Number of index entries
+    uint32_t padding;
+};
+
+struct binary_entry {
+    uint32_t name_offset;       // Offset of null terminated name
+    uint32_t type;              // enum PERSISTENCE_TYPES
+    uint32_t length;            // Number of values stored
+    uint32_t padding;
+    uint64_t data_offset;       // Offset of raw values
+};
+
+
+/* Checks whether the given file is a binary state file, leaves the file
+ * positioned at the start. */
+static bool is_binary_file(FILE *file)
+{
+    char magic[8];
+    bool binary =
+        fread(magic, sizeof(magic), 1, file) == 1  &&
+        memcmp(magic, BINARY_MAGIC, sizeof(magic)) == 0;
+    rewind(file);
+    return binary;
 }
 
 
-/* Parse variable assignment of the form <key>=<value> using the parsing method
- * associated with <key>, or fail if <key> not known. */
-static error__t parse_assignment(struct line_buffer *line)
+/* Validates a single index entry against the variable table and loads its
+ * value with a simple copy. */
+static error__t parse_binary_entry(
+    struct persistence_domain *domain,
+    const char *map, size_t size, const struct binary_entry *entry)
 {
-    char *equal;
+    const char *name = map + entry->name_offset;
     struct persistent_variable *persistence = NULL;
     error__t error =
-        TEST_OK_(equal = strchr(line->line, '='), "Missing =")  ?:
-        DO(*equal++ = '\0')  ?:
-        TEST_OK_(persistence = hash_table_lookup(variable_table, line->line),
-            "Persistence key \"%s\" not found", line->line)  ?:
-        parse_value(line, equal, persistence);
+        TEST_OK_(entry->name_offset < size  &&
+            memchr(name, '\0', size - entry->name_offset),
+            "Invalid name offset")  ?:
+        TEST_OK_(persistence = lookup_variable(domain, name),
+            "Persistence key \"%s\" not found", name)  ?:
+        TEST_OK_(entry->type < ARRAY_SIZE(persistent_actions)  &&
+            &persistent_actions[entry->type] == persistence->action,
+            "Type mismatch for %s", name)  ?:
+        TEST_OK_(entry->length <= persistence->max_length,
+            "Too many values for %s", name)  ?:
+        TEST_OK_(entry->data_offset <= size  &&
+            entry->length * persistence->action->size <=
+                size - entry->data_offset,
+            "Invalid data offset for %s", name);
+    if (!error)
+    {
+        memcpy(persistence->variable, map + entry->data_offset,
+            entry->length * persistence->action->size);
+        persistence->length = entry->length;
+        mark_variable_dirty(persistence);
+    }
+    return error;
+}
 
-    /* Report location of error and flush any continuation lines. */
-    if (error)
+
+static error__t parse_binary_map(
+    struct persistence_domain *domain,
+    const char *map, size_t size, const char *filename, bool check_parse)
+{
+    const struct binary_header *header = (const void *) map;
+    const struct binary_entry *entries = (const void *) (header + 1);
+    error__t error =
+        TEST_OK_(header->version == BINARY_VERSION,
+            "Unsupported version %u", header->version)  ?:
+        TEST_OK_(header->byte_order == BINARY_BYTE_ORDER,
+            "State file written with different byte order")  ?:
+        TEST_OK_(header->count <=
+            (size - sizeof(struct binary_header)) / sizeof(struct binary_entry),
+            "State file index truncated");
+
+    for (uint32_t i = 0; !error  &&  i < header->count; i ++)
     {
-        error_extend(error,
-            "Error parsing %s on line %d of state file %s",
-            persistence ? persistence->name : "(unknown)",
-            line->line_number, state_filename);
-        flush_continuation(line);
+        error = parse_binary_entry(domain, map, size, &entries[i]);
+        if (error)
+            error_extend(error,
+                "Error parsing entry %u of state file %s", i, filename);
+        if (!check_parse)
+        {
+            /* As for the text file, only fail if check_parse is set. */
+            error_report(error);
+            error = ERROR_OK;
+        }
     }
     return error;
 }
 
 
-static error__t parse_persistence_file(const char *filename, bool check_parse)
+static error__t parse_binary_file(
+    struct persistence_domain *domain,
+    FILE *file, const char *filename, bool check_parse)
+{
+    void *map;
+    size_t size;
+    return
+        map_state_file(file, filename, &map, &size)  ?:
+        TEST_OK_(size >= sizeof(struct binary_header),
+            "State file %s truncated", filename)  ?:
+        DO_FINALLY(
+            parse_binary_map(domain, map, size, filename, check_parse),
+            munmap(map, size));
+}
+
+
+/* Opens the state file and loads it, detecting the format from its content.
+ * If the file isn't present this is only an error if required is set. */
+static error__t parse_persistence_file(
+    struct persistence_domain *domain,
+    const char *filename, bool check_parse, bool required)
 {
-    struct line_buffer line = {
-        .file = fopen(filename, "r"),
-        .line_number = 0 };
-    error__t error = TEST_OK_IO_(line.file,
+    FILE *file = fopen(filename, "r");
+    error__t error = TEST_OK_IO_(file,
         "Unable to open state file %s", filename);
-    if (error_report(error))
+    if (error  &&  !required)
+    {
         /* If persistence file isn't found we report open failure but don't
          * fail -- this isn't really an error. */
+        error_report(error);
         return ERROR_OK;
+    }
+
+    /* If the file isn't in the selected format ensure it will be rewritten. */
+    bool binary = !error  &&  is_binary_file(file);
+    if (domain  &&  binary !=
+            (domain->persistence_format == PERSISTENCE_FORMAT_BINARY))
+        domain->rewrite_state = true;
+    return
+        error  ?:
+        DO_FINALLY(
+            IF_ELSE(binary,
+                parse_binary_file(domain, file, filename, check_parse),
+                parse_text_file(domain, file, filename, check_parse)),
+            fclose(file));
+}
+
 
-    while (!error)
+/* Writes the given snapshot of variables to file in binary format. */
+static void write_binary_lines(
+    FILE *out, struct persistent_variable *variables[], unsigned int count)
+{
+    /* First count the stored variables and compute the size of the index and
+     * name table, we need these to compute the data offsets. */
+    uint32_t stored = 0;
+    size_t names_size = 0;
+    for (unsigned int i = 0; i < count; i ++)
+        if (variables[i]->saved_length > 0)
+        {
+            stored += 1;
+            names_size += strlen(variables[i]->name) + 1;
+        }
+    size_t names_offset =
+        sizeof(struct binary_header) + stored * sizeof(struct binary_entry);
+    size_t data_offset = BINARY_ALIGN(names_offset + names_size);
+
+    struct binary_header header = {
+        .magic = BINARY_MAGIC,
+        .version = BINARY_VERSION,
+        .byte_order = BINARY_BYTE_ORDER,
+        .count = stored,
+    };
+    fwrite(&header, sizeof(header), 1, out);
+
+    /* The index. */
+    size_t name_offset = names_offset;
+    for (unsigned int i = 0; i < count; i ++)
     {
-        bool eof = false;
-        error = read_line(&line, &eof);
-        if (error  ||  eof)
-            break;
+        const struct persistent_variable *persistence = variables[i];
+        if (persistence->saved_length > 0)
+        {
+            struct binary_entry entry = {
+                .name_offset = (uint32_t) name_offset,
+                .type = (uint32_t) (persistence->action - persistent_actions),
+                .length = persistence->saved_length,
+                .data_offset = data_offset,
+            };
+            fwrite(&entry, sizeof(entry), 1, out);
+            name_offset += strlen(persistence->name) + 1;
+            data_offset += BINARY_ALIGN(
+                persistence->saved_length * persistence->action->size);
+        }
+    }
 
-        /* Skip lines beginning with # and blank lines. */
-        if (line.line[0] != '#'  &&  line.line[0] != '\n')
+    /* The names followed by the data. */
+    static const char padding[8];
+    for (unsigned int i = 0; i < count; i ++)
+        if (variables[i]->saved_length > 0)
+            fwrite(variables[i]->name, strlen(variables[i]->name) + 1, 1, out);
+    fwrite(padding, BINARY_ALIGN(name_offset) - name_offset, 1, out);
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        const struct persistent_variable *persistence = variables[i];
+        size_t size = persistence->saved_length * persistence->action->size;
+        if (size > 0)
         {
-            error = parse_assignment(&line);
-            if (!check_parse)
-            {
-                /* Although line parsing can fail, we only report errors if
-                 * check_parse is not set.  This means that we will complete the
-                 * loading of a broken state file (for example, if keys have
-                 * changed), error messages will be printed, but this function
-                 * will succeed. */
-                error_report(error);
-                error = ERROR_OK;
-            }
+            fwrite(persistence->saved, size, 1, out);
+            fwrite(padding, BINARY_ALIGN(size) - size, 1, out);
         }
     }
-    fclose(line.file);
-    return error;
 }
 
 
@@ -485,10 +1236,10 @@ static error__t parse_persistence_file(const char *filename, bool check_parse)
 static void write_lines(
     FILE *out, const char *name, const struct persistent_variable *persistence)
 {
-    const void *variable = persistence->variable;
+    const void *variable = persistence->saved;
     unsigned int size = persistence->action->size;
     int line_length = fprintf(out, "%s=", name);
-    for (unsigned int i = 0; i < persistence->length; i ++)
+    for (unsigned int i = 0; i < persistence->saved_length; i ++)
     {
         if (line_length > 72)
         {
@@ -507,137 +1258,1099 @@ static void write_lines(
 }
 
 
-/* Writes persistent state to given file. */
-static error__t write_persistent_state(const char *filename)
+/* Brings the saved copy of a variable up to date by copying the chunks which
+ * have changed since the last snapshot. */
+static void snapshot_dirty_chunks(struct persistent_variable *persistence)
 {
-    FILE *out;
-    error__t error =
-        TEST_OK_IO_(out = fopen(filename, "w"),
-            "Unable to write persistent state: cannot open \"%s\"",
-            filename);
-    if (error)
-        return error;
+    size_t size = persistence->max_length * persistence->action->size;
+    for (unsigned int chunk = 0; chunk < persistence->chunk_count; chunk ++)
+        if (persistence->dirty_chunks[chunk])
+        {
+            size_t offset = (size_t) chunk * CHUNK_SIZE;
+            memcpy(persistence->saved + offset,
+                persistence->variable + offset,
+                MIN((size_t) CHUNK_SIZE, size - offset));
+            persistence->dirty_chunks[chunk] = false;
+        }
+}
 
-    /* Start with a timestamp log. */
-    char out_buffer[40];
-    time_t now = time(NULL);
-    const char *timestamp = ctime_r(&now, out_buffer);
-    fprintf(out, "# Written: %s", timestamp);
 
-    int ix = 0;
-    const void *key;
-    void *value;
-    while (hash_table_walk(variable_table, &ix, &key, &value))
+/* Takes a snapshot of all changed variables in the domain into their saved
+ * copies and returns an array of all variables to be written.  Must be called
+ * with both domain mutex and save_mutex held, and is the only part of saving
+ * state which blocks writers to persistent variables. */
+static struct persistent_variable **snapshot_persistent_state(
+    struct persistence_domain *domain, unsigned int *count)
+{
+    struct persistent_variable **variables =
+        calloc(variable_table_count(domain->variable_table),
+            sizeof(struct persistent_variable *));
+    *count = 0;
+
+    size_t ix = 0;
+    struct persistent_variable *persistence;
+    while (variable_table_walk(
+            domain->variable_table, &ix, NULL, &persistence))
     {
-        const char *name = key;
-        struct persistent_variable *persistence = value;
-        if (persistence->length > 0)
-            write_lines(out, name, persistence);
+        if (persistence->dirty)
+        {
+            snapshot_dirty_chunks(persistence);
+            persistence->saved_length = persistence->length;
+            persistence->dirty = false;
+            persistence->journal = true;
+            persistence->reformat = true;
+        }
+        variables[(*count)++] = persistence;
     }
-    fclose(out);
-    return ERROR_OK;
+    domain->dirty_count = 0;
+    return variables;
 }
 
 
-/* Updates persistent state via a backup file to avoid data loss (assuming
- * rename is implemented as an OS atomic action). */
-error__t update_persistent_state(void)
+/* Formatting the text for large waveforms is expensive, so we keep the
+ * formatted text of each variable and only reformat it when its saved snapshot
+ * has changed.  Must be called with save_mutex held. */
+static void format_saved_text(struct persistent_variable *persistence)
 {
-    if (persistence_dirty  &&  state_filename != NULL)
+    if (persistence->reformat)
     {
-        /* By writing to a backup file first we can then rely on the OS
-         * implementing rename as an atomic operation to achieve a safe atomic
-         * update of the stored state. */
-        size_t name_len = strlen(state_filename);
-        char backup_file[name_len + strlen(".backup") + 1];
-        sprintf(backup_file, "%s.backup", state_filename);
-        return
-            write_persistent_state(backup_file)  ?:
-            TEST_IO(rename(backup_file, state_filename));
+        free(persistence->text);
+        FILE *out = open_memstream(
+            &persistence->text, &persistence->text_length);
+        ASSERT_OK(out);
+        write_lines(out, persistence->name, persistence);
+        fclose(out);
+        persistence->reformat = false;
     }
-    else
-        return ERROR_OK;
 }
 
 
-
-/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-/* Top level control. */
-
-
-/* Wrapper to wait for a pthread condition with a timeout. */
-#define NSECS   1000000000
-static void pwait_timeout(int secs, long nsecs)
+/* Writes the given iovec array, allowing for partial writes. */
+static error__t write_iovec(int file, struct iovec iov[], int count)
 {
-    struct timespec timeout;
-    ASSERT_IO(clock_gettime(CLOCK_REALTIME, &timeout));
-    timeout.tv_sec += secs;
-    timeout.tv_nsec += nsecs;
+    error__t error = ERROR_OK;
+    while (!error  &&  count > 0)
+    {
+        ssize_t written;
+        error = TEST_IO(written = writev(file, iov, count));
+        if (!error)
+        {
+            /* Skip over the completely written buffers and adjust the start of
+             * any partially written buffer. */
+            size_t remaining = (size_t) written;
+            while (count > 0  &&  remaining >= iov->iov_len)
+            {
+                remaining -= iov->iov_len;
+                iov += 1;
+                count -= 1;
+            }
+            if (count > 0)
+            {
+                iov->iov_base = (char *) iov->iov_base + remaining;
+                iov->iov_len -= remaining;
+            }
+        }
+    }
+    return error;
+}
+
+
+/* Writes the given snapshot of variables to file in text format.  Only changed
+ * variables are formatted, and the file is written from the formatted text of
+ * each variable with as few writev calls as possible. */
+static error__t write_text_lines(
+    int file, struct persistent_variable *variables[], unsigned int count)
+{
+    /* Start with a timestamp log. */
+    char out_buffer[40];
+    char header[64];
+    time_t now = time(NULL);
+    const char *timestamp = ctime_r(&now, out_buffer);
+    int header_length = snprintf(header, sizeof(header),
+        "# Written: %s", timestamp);
+
+    struct iovec *iov = calloc(IOV_MAX, sizeof(struct iovec));
+    int iov_count = 0;
+    iov[iov_count++] = (struct iovec) {
+        .iov_base = header, .iov_len = (size_t) header_length };
+
+    error__t error = ERROR_OK;
+    for (unsigned int i = 0; !error  &&  i < count; i ++)
+    {
+        struct persistent_variable *persistence = variables[i];
+        if (persistence->saved_length > 0)
+        {
+            format_saved_text(persistence);
+            iov[iov_count++] = (struct iovec) {
+                .iov_base = persistence->text,
+                .iov_len = persistence->text_length };
+            if (iov_count == IOV_MAX)
+            {
+                error = write_iovec(file, iov, iov_count);
+                iov_count = 0;
+            }
+        }
+    }
+    error = error  ?:  write_iovec(file, iov, iov_count);
+    free(iov);
+    return error;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Durable flushing. */
+
+/* Depending on the durability level each written file is flushed to storage
+ * before it is renamed into place, and the directory is then flushed so that
+ * the rename itself survives a crash.  As flushing is slow, particularly on
+ * flash storage, flushes are performed as a group commit: a thread requesting
+ * a flush while another flush is in progress waits, and all requests which
+ * accumulate meanwhile are then performed together by a single thread.  This
+ * batches the flushes of concurrent saves from several domains, and each
+ * directory is only flushed once per batch. */
+struct flush_request {
+    int file;                   // File to flush with fdatasync, or -1
+    const char *directory;      // Otherwise directory to flush
+    error__t error;
+    bool done;
+    struct flush_request *next;
+};
+
+static pthread_mutex_t flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_done = PTHREAD_COND_INITIALIZER;
+static enum persistence_durability durability = PERSISTENCE_DURABILITY_NONE;
+/* Set while a thread is performing a batch of flushes. */
+static bool flush_active = false;
+/* Requests waiting for the next batch, in reverse order of arrival. */
+static struct flush_request *flush_pending = NULL;
+
+/* Flush statistics, guarded by flush_mutex. */
+static unsigned int flush_batches;
+static unsigned int flush_requests;
+static double flush_last_latency;
+static double flush_max_latency;
+static double flush_total_latency;
+
+
+static error__t flush_directory(const char *directory)
+{
+    int dir;
+    return
+        TEST_IO_(dir = open(directory, O_RDONLY | O_DIRECTORY),
+            "Unable to open directory \"%s\"", directory)  ?:
+        DO_FINALLY(
+            TEST_IO_(fsync(dir), "Unable to flush directory \"%s\"", directory),
+            close(dir));
+}
+
+
+/* Performs a batch of flushes: all files first, then each distinct directory
+ * once.  Requests for a directory already flushed successfully in this batch
+ * share the earlier flush. */
+static void perform_flushes(struct flush_request *requests)
+{
+    for (struct flush_request *request = requests; request;
+         request = request->next)
+        if (request->file >= 0)
+            request->error = TEST_IO_(fdatasync(request->file),
+                "Unable to flush persistent state");
+
+    for (struct flush_request *request = requests; request;
+         request = request->next)
+        if (request->file < 0)
+        {
+            bool flushed = false;
+            for (struct flush_request *earlier = requests;
+                 earlier != request; earlier = earlier->next)
+                flushed = flushed  ||  (earlier->file < 0  &&
+                    !earlier->error  &&
+                    strcmp(earlier->directory, request->directory) == 0);
+            if (!flushed)
+                request->error = flush_directory(request->directory);
+        }
+}
+
+
+/* Performs one batch of pending flushes.  Called with flush_mutex held, which
+ * is released while flushing. */
+static void lead_flush_batch(void)
+{
+    struct flush_request *requests = flush_pending;
+    flush_pending = NULL;
+    flush_active = true;
+
+    double start = monotonic_seconds();
+    ASSERT_PTHREAD(pthread_mutex_unlock(&flush_mutex));
+    perform_flushes(requests);
+    ASSERT_PTHREAD(pthread_mutex_lock(&flush_mutex));
+    double latency = monotonic_seconds() - start;
+
+    flush_batches += 1;
+    flush_last_latency = latency;
+    flush_max_latency = MAX(flush_max_latency, latency);
+    flush_total_latency += latency;
+    for (struct flush_request *request = requests; request;
+         request = request->next)
+    {
+        flush_requests += 1;
+        request->done = true;
+    }
+    flush_active = false;
+    pthread_cond_broadcast(&flush_done);
+}
+
+
+/* Adds the request to the next batch and waits for it to complete, performing
+ * the batch ourself if no other thread is flushing. */
+static error__t group_flush(
+    struct flush_request *request, enum persistence_durability required)
+{
+    WITH_MUTEX(flush_mutex)
+    {
+        if (durability < required)
+            request->done = true;
+        else
+        {
+            request->next = flush_pending;
+            flush_pending = request;
+        }
+        while (!request->done)
+        {
+            if (flush_active)
+                pthread_cond_wait(&flush_done, &flush_mutex);
+            else
+                lead_flush_batch();
+        }
+    }
+    return request->error;
+}
+
+
+/* Flushes the contents of a newly written file if required. */
+static error__t flush_file(int file)
+{
+    struct flush_request request = { .file = file };
+    return group_flush(&request, PERSISTENCE_DURABILITY_DATA);
+}
+
+
+/* Flushes the directory containing the given file if required. */
+static error__t flush_file_directory(const char *filename)
+{
+    char directory[strlen(filename) + 1];
+    strcpy(directory, filename);
+    struct flush_request request = {
+        .file = -1, .directory = dirname(directory) };
+    return group_flush(&request, PERSISTENCE_DURABILITY_FULL);
+}
+
+
+void set_persistence_durability(enum persistence_durability level)
+{
+    WITH_MUTEX(flush_mutex)
+        durability = level;
+}
+
+
+void report_persistence_flush(void)
+{
+    WITH_MUTEX(flush_mutex)
+    {
+        static const char *levels[] = { "none", "data", "full" };
+        printf("Durability %s: %u flushes in %u batches\n",
+            levels[durability], flush_requests, flush_batches);
+        if (flush_batches > 0)
+            printf("Batch latency: last %.3f ms, mean %.3f ms, max %.3f ms\n",
+                1e3 * flush_last_latency,
+                1e3 * flush_total_latency / flush_batches,
+                1e3 * flush_max_latency);
+    }
+}
+
+
+/* Writes persistent state snapshot to given file in the requested format, and
+ * adds the size of the file to *written.  Called with save_mutex held, but
+ * without holding the variable mutex. */
+static error__t write_persistent_state(
+    const char *filename, enum persistence_format format,
+    struct persistent_variable *variables[], unsigned int count,
+    size_t *written)
+{
+    FILE *out;
+    error__t error =
+        TEST_OK_IO_(out = fopen(filename, "w"),
+            "Unable to write persistent state: cannot open \"%s\"",
+            filename);
+    if (error)
+        return error;
+
+    switch (format)
+    {
+        case PERSISTENCE_FORMAT_TEXT:
+            error = write_text_lines(fileno(out), variables, count);
+            break;
+        case PERSISTENCE_FORMAT_BINARY:
+            write_binary_lines(out, variables, count);
+            break;
+    }
+    bool write_ok = fflush(out) == 0  &&  !ferror(out);
+    struct stat st;
+    error = error  ?:
+        TEST_OK_IO_(write_ok,
+            "Error writing persistent state to \"%s\"", filename)  ?:
+        TEST_IO(fstat(fileno(out), &st))  ?:
+        DO(*written += (size_t) st.st_size)  ?:
+        flush_file(fileno(out));
+    bool close_ok = fclose(out) == 0;
+    return error  ?:  TEST_OK_IO_(close_ok,
+        "Error writing persistent state to \"%s\"", filename);
+}
+
 
-    if (timeout.tv_nsec >= NSECS)
+/* Removes the journal after its contents have been written to the state file.
+ * It's not an error if there is no journal. */
+static error__t discard_journal(struct persistence_domain *domain)
+{
+    if (domain->journal_file)
     {
-        timeout.tv_nsec -= NSECS;
-        timeout.tv_sec += 1;
+        fclose(domain->journal_file);
+        domain->journal_file = NULL;
     }
-    pthread_cond_timedwait(&psignal, &mutex, &timeout);
+    return TEST_OK_IO_(
+        unlink(domain->journal_filename) == 0  ||  errno == ENOENT,
+        "Unable to remove journal file \"%s\"", domain->journal_filename);
 }
 
 
-/* This thread is responsible for ensuring the persistent state file is up to
- * date.  It wakes up periodically to check if anything has changed, and if it
- * has, ensures the state file is updated.  The file is also written on shutdown
- * if necessary. */
+/* Writes the snapshot via a backup file to avoid data loss (assuming rename is
+ * implemented as an OS atomic action).  How far the new file is flushed to
+ * storage depends on the durability level. */
+static error__t write_state_file(
+    struct persistence_domain *domain,
+    struct persistent_variable *variables[], unsigned int count,
+    size_t *written)
+{
+    /* By writing to a backup file first we can then rely on the OS
+     * implementing rename as an atomic operation to achieve a safe atomic
+     * update of the stored state. */
+    size_t name_len = strlen(domain->state_filename);
+    char backup_file[name_len + strlen(".backup") + 1];
+    sprintf(backup_file, "%s.backup", domain->state_filename);
+    return
+        write_persistent_state(backup_file,
+            domain->persistence_format, variables, count, written)  ?:
+        TEST_IO(rename(backup_file, domain->state_filename))  ?:
+        flush_file_directory(domain->state_filename)  ?:
+        discard_journal(domain);
+}
+
+
+/* Appends all variables changed since the last journal update to the journal
+ * file.  When the journal becomes too large it is folded into the state file;
+ * note that this is done from the same snapshot, so that replaying the journal
+ * over the new state file will still produce the same state. */
+static error__t append_journal(
+    struct persistence_domain *domain,
+    struct persistent_variable *variables[], unsigned int count,
+    size_t *written)
+{
+    FILE *journal_file = domain->journal_file;
+    const char *journal_filename = domain->journal_filename;
+    /* A newly opened journal may have just been created, in which case its
+     * directory entry also needs flushing. */
+    bool opened = !journal_file;
+    error__t error = IF(opened,
+        TEST_OK_IO_(
+            journal_file = domain->journal_file = fopen(journal_filename, "a"),
+            "Unable to open journal file \"%s\"", journal_filename));
+    if (error)
+        return error;
+
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        struct persistent_variable *persistence = variables[i];
+        if (persistence->journal)
+        {
+            /* An empty assignment in the journal is harmless. */
+            format_saved_text(persistence);
+            fwrite(persistence->text, persistence->text_length, 1,
+                journal_file);
+            *written += persistence->text_length;
+            persistence->journal = false;
+        }
+    }
+
+    long journal_size;
+    error =
+        TEST_OK_IO_(fflush(journal_file) == 0  &&  !ferror(journal_file),
+            "Error writing journal file \"%s\"", journal_filename)  ?:
+        flush_file(fileno(journal_file))  ?:
+        IF(opened, flush_file_directory(journal_filename))  ?:
+        TEST_IO(journal_size = ftell(journal_file))  ?:
+        IF((size_t) journal_size > domain->journal_limit,
+            write_state_file(domain, variables, count, written));
+    /* After a failure the error state of the journal file is sticky, so we
+     * close it.  The journal is discarded when the caller rewrites the state
+     * file. */
+    if (error  &&  domain->journal_file)
+    {
+        fclose(domain->journal_file);
+        domain->journal_file = NULL;
+    }
+    return error;
+}
+
+
+/* Records the duration and size of a completed save. */
+static void record_save(double duration, size_t written)
+{
+    WITH_MUTEX(stats_mutex)
+    {
+        save_count += 1;
+        last_save_time = duration;
+        last_save_bytes = written;
+        bytes_written += written;
+    }
+}
+
+
+/* Updates the persistent state of one domain.  The domain mutex is only held
+ * while taking a snapshot of changed variables, so writers to persistent
+ * variables are not blocked while the state file is formatted and written. */
+static error__t update_domain_state(struct persistence_domain *domain)
+{
+    error__t error = ERROR_OK;
+    WITH_MUTEX(domain->save_mutex)
+    {
+        double start = monotonic_seconds();
+        size_t written = 0;
+        struct persistent_variable **variables = NULL;
+        unsigned int count = 0;
+        bool rewrite = false;
+        WITH_MUTEX(domain->mutex)
+            if (domain->persistence_dirty  &&  domain->state_filename)
+            {
+                variables = snapshot_persistent_state(domain, &count);
+                rewrite = domain->rewrite_state;
+                domain->persistence_dirty = false;
+                domain->rewrite_state = false;
+                domain->save_scheduled = false;
+            }
+
+        if (variables)
+        {
+            error = IF_ELSE(domain->journal_limit > 0  &&  !rewrite,
+                append_journal(domain, variables, count, &written),
+                write_state_file(domain, variables, count, &written));
+            record_save(monotonic_seconds() - start, written);
+        }
+        /* The changes in the snapshot may not have been saved, and are no
+         * longer marked as changed, so the complete state file is rewritten on
+         * the next save. */
+        if (error)
+            WITH_MUTEX(domain->mutex)
+            {
+                domain->rewrite_state = true;
+                schedule_domain_save(domain);
+            }
+        free(variables);
+    }
+    return error;
+}
+
+
+error__t update_persistent_state(void)
+{
+    error__t error = ERROR_OK;
+    FOR_EACH_DOMAIN(domain)
+        if (!error)
+            error = update_domain_state(domain);
+    return error;
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Top level control. */
+
+
+/* Waits until a scheduled save is due or the thread is asked to terminate.
+ * Called with the domain mutex held. */
+static void wait_for_save(struct persistence_domain *domain)
+{
+    while (domain->thread_running)
+    {
+        struct timespec now;
+        if (!domain->save_scheduled)
+            pthread_cond_wait(&domain->psignal, &domain->mutex);
+        else if (
+            ASSERT_IO(clock_gettime(CLOCK_REALTIME, &now)),
+            time_before(&now, &domain->save_deadline))
+            pthread_cond_timedwait(
+                &domain->psignal, &domain->mutex, &domain->save_deadline);
+        else
+            break;
+    }
+}
+
+
+/* Each domain has a thread responsible for ensuring its state file is up to
+ * date.  It sleeps until a save scheduled by a change falls due and then
+ * updates the state file.  The file is also written on shutdown if
+ * necessary. */
 static void *persistence_thread(void *context)
 {
-    WITH_MUTEX(mutex)
+    struct persistence_domain *domain = context;
+    bool running = true;
+    while (running)
     {
-        while (thread_running)
+        WITH_MUTEX(domain->mutex)
         {
-            pwait_timeout(persistence_interval, 0);
-            error_report(update_persistent_state());
-            persistence_dirty = false;
+            wait_for_save(domain);
+            running = domain->thread_running;
         }
+        error_report(update_domain_state(domain));
     }
     return NULL;
 }
 
 
-/* Must be called before marking any variables as persistent. */
-void initialise_persistent_state(void)
+/* After loading the state file all loaded values are saved as our initial
+ * snapshot: only subsequent changes need to be journaled. */
+static void take_initial_snapshot(struct persistence_domain *domain)
+{
+    WITH_MUTEX(domain->save_mutex)
+    {
+        unsigned int count;
+        struct persistent_variable **variables;
+        WITH_MUTEX(domain->mutex)
+            variables = snapshot_persistent_state(domain, &count);
+        for (unsigned int i = 0; i < count; i ++)
+            variables[i]->journal = false;
+        free(variables);
+    }
+}
+
+
+/* Loading state can touch variables in any domain, so all domain mutexes are
+ * taken, in list order.  Must be called with domains_mutex held. */
+static void lock_all_domains(void)
+{
+    FOR_EACH_DOMAIN(domain)
+        ASSERT_PTHREAD(pthread_mutex_lock(&domain->mutex));
+}
+
+static void unlock_all_domains(void)
+{
+    FOR_EACH_DOMAIN(domain)
+        ASSERT_PTHREAD(pthread_mutex_unlock(&domain->mutex));
+}
+
+
+/* Schedules a save of every domain whose state file needs rewriting after
+ * loading.  Called with domains_mutex and all domain mutexes held. */
+static void schedule_rewrites(void)
+{
+    FOR_EACH_DOMAIN(domain)
+        if (domain->rewrite_state)
+            schedule_domain_save(domain);
+}
+
+
+/* Loads the state file of a domain and replays any journal over it.  If we're
+ * not in journal mode then the journal is folded into the state file on the
+ * next save.  Called with domains_mutex and all domain mutexes held. */
+static error__t load_domain_state(
+    struct persistence_domain *domain, bool check_parse)
+{
+    bool replay_journal = access(domain->journal_filename, F_OK) == 0;
+    return
+        parse_persistence_file(
+            domain, domain->state_filename, check_parse, false)  ?:
+        IF(replay_journal,
+            parse_persistence_file(
+                domain, domain->journal_filename, check_parse, true)  ?:
+            IF(domain->journal_limit == 0,
+                DO(domain->rewrite_state = true)));
+}
+
+
+/* Each domain must have its own state file.  Called with domains_mutex held. */
+static error__t check_state_filename(const char *file_name)
 {
-    variable_table = hash_table_create(false);  // We look after name lifetime
+    error__t error = ERROR_OK;
+    FOR_EACH_DOMAIN(domain)
+        if (!error  &&  domain->state_filename)
+            error = TEST_OK_(strcmp(domain->state_filename, file_name),
+                "State file %s already in use", file_name);
+    return error;
+}
+
+
+/* Must be called before marking any variables as persistent.  Can be called
+ * again to reserve space for more variables. */
+void initialise_persistent_state(unsigned int count)
+{
+    if (variable_table == NULL)
+    {
+        variable_table = variable_table_create();
+        default_domain.variable_table = variable_table_create();
+    }
+    variable_table_reserve(variable_table, count);
+    variable_table_reserve(default_domain.variable_table, count);
+}
+
+
+/* Creates a new domain and moves any existing variables now matching it into
+ * the new domain.  Called with domains_mutex held. */
+static void create_domain(
+    const char *prefix, const char *file_name, int save_interval)
+{
+    /* New domains inherit the current settings of the default domain. */
+    struct persistence_domain *domain =
+        malloc(sizeof(struct persistence_domain));
+    *domain = (struct persistence_domain) {
+        .prefix = strdup(prefix),
+        .variable_table = variable_table_create(),
+        .state_filename = strdup(file_name),
+        .journal_limit = default_domain.journal_limit,
+        .persistence_interval = save_interval,
+        .save_debounce = default_domain.save_debounce,
+        .persistence_format = default_domain.persistence_format,
+        .thread_running = true,
+        .next = domains,
+    };
+    ASSERT_IO(asprintf(&domain->journal_filename, "%s.journal", file_name));
+    ASSERT_PTHREAD(pthread_mutex_init(&domain->mutex, NULL));
+    ASSERT_PTHREAD(pthread_mutex_init(&domain->save_mutex, NULL));
+    ASSERT_PTHREAD(pthread_cond_init(&domain->psignal, NULL));
+    domains = domain;
+
+    lock_all_domains();
+    size_t ix = 0;
+    struct persistent_variable *persistence;
+    while (variable_table_walk(variable_table, &ix, NULL, &persistence))
+    {
+        if (persistence->domain != domain  &&
+            match_name_prefix(persistence->name, prefix))
+        {
+            remove_domain_variable(persistence->domain, persistence);
+            add_domain_variable(domain, persistence);
+            persistence->domain = domain;
+        }
+    }
+    unlock_all_domains();
+}
+
+
+error__t add_persistence_domain(
+    const char *prefix, const char *file_name, int save_interval)
+{
+    error__t error;
+    WITH_MUTEX(domains_mutex)
+    {
+        error =
+            TEST_OK_(!state_loaded,
+                "Persistence domains must be added before loading state")  ?:
+            check_state_filename(file_name);
+        if (!error)
+            create_domain(prefix, file_name, save_interval);
+    }
+    return error;
+}
+
+
+void set_persistence_format(enum persistence_format format)
+{
+    WITH_MUTEX(domains_mutex)
+        FOR_EACH_DOMAIN(domain)
+            WITH_MUTEX(domain->save_mutex)
+            {
+                /* Force the state file to be rewritten in the new format. */
+                if (format != domain->persistence_format)
+                    WITH_MUTEX(domain->mutex)
+                    {
+                        domain->rewrite_state = true;
+                        schedule_domain_save(domain);
+                    }
+                domain->persistence_format = format;
+            }
+}
+
+
+void set_persistence_journal(size_t compact_size)
+{
+    WITH_MUTEX(domains_mutex)
+        FOR_EACH_DOMAIN(domain)
+            WITH_MUTEX(domain->save_mutex)
+                domain->journal_limit = compact_size;
+}
+
+
+void set_persistence_debounce(double debounce)
+{
+    WITH_MUTEX(domains_mutex)
+        FOR_EACH_DOMAIN(domain)
+            WITH_MUTEX(domain->mutex)
+                domain->save_debounce = debounce;
+}
+
+
+void set_persistence_latency(const char *prefix, double max_latency)
+{
+    struct latency_class *class = malloc(sizeof(struct latency_class));
+    class->prefix = strdup(prefix);
+    class->max_latency = max_latency;
+    WITH_MUTEX(domains_mutex)
+    {
+        class->next = latency_classes;
+        latency_classes = class;
+
+        /* Apply the new class to all existing matching variables. */
+        FOR_EACH_DOMAIN(domain)
+            WITH_MUTEX(domain->mutex)
+            {
+                size_t ix = 0;
+                struct persistent_variable *persistence;
+                while (variable_table_walk(
+                        domain->variable_table, &ix, NULL, &persistence))
+                {
+                    if (match_name_prefix(persistence->name, prefix))
+                        persistence->max_latency = max_latency;
+                }
+            }
+    }
+}
+
+
+/* The snapshot of each domain is taken in turn, and every save_mutex is held
+ * until the file is written so that the saved snapshots remain stable. */
+error__t export_persistent_state(const char *file_name)
+{
+    error__t error;
+    WITH_MUTEX(domains_mutex)
+    {
+        struct persistent_variable **variables =
+            calloc(variable_table_count(variable_table),
+                sizeof(struct persistent_variable *));
+        unsigned int count = 0;
+        FOR_EACH_DOMAIN(domain)
+        {
+            ASSERT_PTHREAD(pthread_mutex_lock(&domain->save_mutex));
+            struct persistent_variable **domain_variables;
+            unsigned int domain_count;
+            WITH_MUTEX(domain->mutex)
+                domain_variables =
+                    snapshot_persistent_state(domain, &domain_count);
+            memcpy(variables + count, domain_variables,
+                domain_count * sizeof(struct persistent_variable *));
+            count += domain_count;
+            free(domain_variables);
+        }
+
+        size_t written = 0;
+        error = write_persistent_state(
+            file_name, PERSISTENCE_FORMAT_TEXT, variables, count, &written);
+
+        FOR_EACH_DOMAIN(domain)
+            ASSERT_PTHREAD(pthread_mutex_unlock(&domain->save_mutex));
+        free(variables);
+    }
+    return error;
+}
+
+
+/* The imported file doesn't belong to any domain, so every domain owning an
+ * imported variable has its state file rewritten. */
+error__t import_persistent_state(const char *file_name, bool check_parse)
+{
+    error__t error;
+    WITH_MUTEX(domains_mutex)
+    {
+        lock_all_domains();
+        error = parse_persistence_file(NULL, file_name, check_parse, true);
+        if (!error)
+            schedule_rewrites();
+        unlock_all_domains();
+    }
+    return error;
+}
+
+
+/* Loads the state files of all domains and starts their threads.  Called with
+ * domains_mutex held. */
+static error__t load_all_domains(bool check_parse)
+{
+    error__t error = ERROR_OK;
+    double start = monotonic_seconds();
+    lock_all_domains();
+    FOR_EACH_DOMAIN(domain)
+        if (!error)
+            error = load_domain_state(domain, check_parse);
+    schedule_rewrites();
+    unlock_all_domains();
+    WITH_MUTEX(stats_mutex)
+        load_time = monotonic_seconds() - start;
+
+    FOR_EACH_DOMAIN(domain)
+    {
+        take_initial_snapshot(domain);
+        if (!error  &&  domain->persistence_thread_id == 0)
+            error = TEST_PTHREAD(pthread_create(
+                &domain->persistence_thread_id, NULL,
+                persistence_thread, domain));
+    }
+    return error;
 }
 
 
 error__t load_persistent_state(
     const char *file_name, int save_interval, bool check_parse)
 {
-    /* It's more robust to take a copy of the passed filename, places fewer
-     * demands on the caller. */
-    state_filename = strdup(file_name);
-    persistence_interval = save_interval;
+    error__t error;
+    WITH_MUTEX(domains_mutex)
+    {
+        error = check_state_filename(file_name);
+        if (!error)
+        {
+            /* It's more robust to take a copy of the passed filename, places
+             * fewer demands on the caller. */
+            default_domain.state_filename = strdup(file_name);
+            ASSERT_IO(asprintf(&default_domain.journal_filename,
+                "%s.journal", file_name));
+            default_domain.persistence_interval = save_interval;
+            state_loaded = true;
+            error = load_all_domains(check_parse);
+        }
+    }
+    return error;
+}
+
+
+/* Variable counts and lock waits are gathered from each domain in turn, so
+ * the result is not an atomic snapshot of all domains. */
+void get_persistence_stats(struct persistence_stats *stats)
+{
+    *stats = (struct persistence_stats) { };
+    WITH_MUTEX(domains_mutex)
+        FOR_EACH_DOMAIN(domain)
+            WITH_MUTEX(domain->mutex)
+            {
+                stats->variable_count += domain->variable_count;
+                stats->variable_bytes += domain->variable_bytes;
+                stats->dirty_count += domain->dirty_count;
+                stats->lock_waits += domain->lock_waits;
+                stats->lock_wait_time += domain->lock_wait_time;
+                stats->max_lock_wait =
+                    MAX(stats->max_lock_wait, domain->max_lock_wait);
+            }
 
-    return
-        ERROR_WITH_MUTEX(mutex,
-            parse_persistence_file(state_filename, check_parse))  ?:
-        IF(persistence_thread_id == 0,
-            TEST_PTHREAD(pthread_create(
-                &persistence_thread_id, NULL, persistence_thread, NULL)));
+    WITH_MUTEX(stats_mutex)
+    {
+        stats->save_count = save_count;
+        stats->last_save_time = last_save_time;
+        stats->last_save_bytes = last_save_bytes;
+        stats->bytes_written = bytes_written;
+        stats->load_time = load_time;
+    }
+    WITH_MUTEX(flush_mutex)
+        stats->flush_latency = flush_last_latency;
 }
 
 
-/* Writes out persistent state file if necessary.  All we have to do in fact is
- * wake up the responsible thread and then wait for it to complete. */
+void report_persistence_stats(void)
+{
+    struct persistence_stats stats;
+    get_persistence_stats(&stats);
+    printf("%u persistent variables, %zu bytes, %u unsaved\n",
+        stats.variable_count, stats.variable_bytes, stats.dirty_count);
+    printf("%u saves, %"PRIu64" bytes written, "
+        "last save %zu bytes in %.3f ms\n",
+        stats.save_count, stats.bytes_written,
+        stats.last_save_bytes, 1e3 * stats.last_save_time);
+    printf("State loaded in %.3f ms\n", 1e3 * stats.load_time);
+    printf("Record threads waited %"PRIu64" times for %.3f ms, "
+        "longest %.3f ms\n",
+        stats.lock_waits, 1e3 * stats.lock_wait_time,
+        1e3 * stats.max_lock_wait);
+    report_persistence_flush();
+}
+
+
+/* Writes out persistent state files if necessary.  All we have to do in fact
+ * is wake up the responsible threads and then wait for them to complete. */
 void terminate_persistent_state(void)
 {
-    /* If no state filename given then do nothing. */
-    if (!state_filename)
-        return;
+    FOR_EACH_DOMAIN(domain)
+        if (domain->persistence_thread_id)
+        {
+            WITH_MUTEX(domain->mutex)
+            {
+                domain->thread_running = false;
+                pthread_cond_signal(&domain->psignal);
+            }
+            pthread_join(domain->persistence_thread_id, NULL);
+        }
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Named snapshots. */
+
+/* A snapshot holds a copy of the value of every persistent variable with a
+ * value at the time of capture. */
+struct snapshot_entry {
+    struct persistent_variable *persistence;
+    unsigned int length;
+    char *value;
+};
+
+struct persistence_snapshot {
+    char *name;
+    unsigned int count;
+    size_t size;                // Total size of captured values
+    struct snapshot_entry *entries;
+    struct persistence_snapshot *next;
+};
+
+/* List of snapshots, guarded by snapshots_mutex, which is held while restoring
+ * a snapshot and so must not be taken by record processing. */
+static pthread_mutex_t snapshots_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct persistence_snapshot *snapshots = NULL;
+static persistence_restore_t *restore_hook = NULL;
+
+
+void set_persistence_restore(persistence_restore_t *restore)
+{
+    restore_hook = restore;
+}
 
-    WITH_MUTEX(mutex)
+
+/* Returns a pointer to the link to the named snapshot, or to the terminating
+ * NULL if not found.  Called with snapshots_mutex held. */
+static struct persistence_snapshot **find_snapshot(const char *name)
+{
+    struct persistence_snapshot **link = &snapshots;
+    while (*link  &&  strcmp((*link)->name, name) != 0)
+        link = &(*link)->next;
+    return link;
+}
+
+
+static void free_snapshot(struct persistence_snapshot *snapshot)
+{
+    for (unsigned int i = 0; i < snapshot->count; i ++)
+        free(snapshot->entries[i].value);
+    free(snapshot->entries);
+    free(snapshot->name);
+    free(snapshot);
+}
+
+
+/* Copies the current value of every variable in the domain with a value into
+ * the snapshot.  Called with the domain mutex held. */
+static void capture_domain(
+    struct persistence_domain *domain, struct persistence_snapshot *snapshot)
+{
+    size_t ix = 0;
+    struct persistent_variable *persistence;
+    while (variable_table_walk(
+            domain->variable_table, &ix, NULL, &persistence))
+    {
+        if (persistence->length > 0)
+        {
+            size_t size = persistence->length * persistence->action->size;
+            struct snapshot_entry *entry = &snapshot->entries[snapshot->count];
+            entry->persistence = persistence;
+            entry->length = persistence->length;
+            entry->value = malloc(size);
+            memcpy(entry->value, persistence->variable, size);
+            snapshot->count += 1;
+            snapshot->size += size;
+        }
+    }
+}
+
+
+void capture_persistence_snapshot(const char *name)
+{
+    struct persistence_snapshot *snapshot =
+        malloc(sizeof(struct persistence_snapshot));
+    *snapshot = (struct persistence_snapshot) { .name = strdup(name) };
+
+    WITH_MUTEX(domains_mutex)
+    {
+        snapshot->entries = calloc(variable_table_count(variable_table),
+            sizeof(struct snapshot_entry));
+        FOR_EACH_DOMAIN(domain)
+            WITH_MUTEX(domain->mutex)
+                capture_domain(domain, snapshot);
+    }
+
+    /* A new snapshot replaces any existing snapshot of the same name. */
+    struct persistence_snapshot *old_snapshot;
+    WITH_MUTEX(snapshots_mutex)
     {
-        thread_running = false;
-        pthread_cond_signal(&psignal);
+        struct persistence_snapshot **link = find_snapshot(name);
+        old_snapshot = *link;
+        snapshot->next = old_snapshot ? old_snapshot->next : NULL;
+        *link = snapshot;
     }
-    pthread_join(persistence_thread_id, NULL);
+    if (old_snapshot)
+        free_snapshot(old_snapshot);
+}
+
+
+/* All values are written in a single pass under snapshots_mutex.  Without a
+ * restore hook each variable is written directly. */
+error__t restore_persistence_snapshot(const char *name)
+{
+    error__t error;
+    WITH_MUTEX(snapshots_mutex)
+    {
+        struct persistence_snapshot *snapshot = *find_snapshot(name);
+        error = TEST_OK_(snapshot, "Snapshot \"%s\" not found", name);
+        unsigned int failed = 0;
+        for (unsigned int i = 0; !error  &&  i < snapshot->count; i ++)
+        {
+            struct snapshot_entry *entry = &snapshot->entries[i];
+            if (restore_hook)
+                failed += !restore_hook(entry->persistence,
+                    entry->persistence->name, entry->value, entry->length);
+            else
+                write_persistent_waveform(
+                    entry->persistence, entry->value, entry->length);
+        }
+        error = error  ?:  TEST_OK_(failed == 0,
+            "Unable to restore %u of %u variables from snapshot \"%s\"",
+            failed, snapshot->count, name);
+    }
+    return error;
+}
+
+
+error__t delete_persistence_snapshot(const char *name)
+{
+    struct persistence_snapshot *snapshot;
+    WITH_MUTEX(snapshots_mutex)
+    {
+        struct persistence_snapshot **link = find_snapshot(name);
+        snapshot = *link;
+        if (snapshot)
+            *link = snapshot->next;
+    }
+    if (snapshot)
+        free_snapshot(snapshot);
+    return TEST_OK_(snapshot, "Snapshot \"%s\" not found", name);
+}
+
+
+void list_persistence_snapshots(void)
+{
+    WITH_MUTEX(snapshots_mutex)
+        for (struct persistence_snapshot *snapshot = snapshots; snapshot;
+             snapshot = snapshot->next)
+            printf("%s: %u variables, %zu bytes\n",
+                snapshot->name, snapshot->count, snapshot->size);
 }
@@ -6,7 +6,98 @@
 error__t load_persistent_state(
     const char *FileName, int save_interval, bool check_parse);
 
+/* Assigns all persistent variables with names starting with prefix, either
+ * including or excluding the record type, to a separate persistence domain
+ * with its own state file and save interval.  Each domain is saved by its own
+ * thread under its own locks.  Must be called before load_persistent_state(),
+ * which loads all domains. */
+error__t add_persistence_domain(
+    const char *prefix, const char *file_name, int save_interval);
+
 /* Writes out persistent state file if necessary. */
 error__t update_persistent_state(void);
 
+/* The state file can be written either as text or in a binary format which is
+ * much faster to load.  The format of the state file is detected automatically
+ * when loading, so changing the format converts the state file on the next
+ * save. */
+enum persistence_format {
+    PERSISTENCE_FORMAT_TEXT,
+    PERSISTENCE_FORMAT_BINARY,
+};
+void set_persistence_format(enum persistence_format format);
+
+/* In journal mode each save appends only the changed variables to the journal
+ * file <state-file>.journal, and the journal is folded into a fresh state file
+ * once it grows larger than compact_size bytes.  Setting compact_size to 0
+ * disables journal mode.  Any journal present when persistent state is loaded
+ * is replayed over the state file. */
+void set_persistence_journal(size_t compact_size);
+
+/* Normally a change to any persistent variable is written to the state file
+ * within the save_interval passed to load_persistent_state().  If a debounce
+ * interval is set then each change defers saving until no further changes have
+ * been made for debounce seconds, but saving is never deferred beyond the
+ * maximum latency.  Setting debounce to 0 disables debouncing. */
+void set_persistence_debounce(double debounce);
+
+/* Sets the maximum latency in seconds for variables whose names start with the
+ * given prefix, either including or excluding the record type, overriding
+ * save_interval.  This allows important settings to be saved promptly. */
+void set_persistence_latency(const char *prefix, double max_latency);
+
+/* Determines how far each save is flushed to storage before it is considered
+ * complete.  By default nothing is flushed and saved state can be lost if the
+ * system crashes shortly after a save.  Flushes requested concurrently, for
+ * instance by saves of several domains, are batched together. */
+enum persistence_durability {
+    PERSISTENCE_DURABILITY_NONE,    // Leave flushing to the operating system
+    PERSISTENCE_DURABILITY_DATA,    // Flush file contents with fdatasync
+    PERSISTENCE_DURABILITY_FULL,    // Also flush the containing directory
+};
+void set_persistence_durability(enum persistence_durability durability);
+
+/* Prints the number of flushes performed and the latency of each batch. */
+void report_persistence_flush(void);
+
+/* Statistics on the cost of persistence.  All times are in seconds. */
+struct persistence_stats {
+    unsigned int variable_count;    // Number of persistent variables
+    size_t variable_bytes;          // Storage used by all variable values
+    unsigned int dirty_count;       // Variables changed since the last save
+    unsigned int save_count;        // Number of saves since startup
+    double last_save_time;          // Duration of the most recent save
+    size_t last_save_bytes;         // Bytes written by the most recent save
+    uint64_t bytes_written;         // Bytes written by all saves
+    double load_time;               // Time taken to load and parse state
+    uint64_t lock_waits;            // Times a record thread had to wait
+    double lock_wait_time;          // Total time record threads waited
+    double max_lock_wait;           // Longest single wait
+    double flush_latency;           // Latency of the last batch of flushes
+};
+void get_persistence_stats(struct persistence_stats *stats);
+
+/* Prints the statistics returned by get_persistence_stats(). */
+void report_persistence_stats(void);
+
+/* Writes the current persistent state to the given file in text format for
+ * inspection, whatever the format of the state file. */
+error__t export_persistent_state(const char *file_name);
+
+/* Loads persistent state from the given file, which can be in either format,
+ * and marks the state file for update.  Note that records only read persistent
+ * state during initialisation, so this should be called before iocInit. */
+error__t import_persistent_state(const char *file_name, bool check_parse);
+
 void terminate_persistent_state(void);
+
+/* Named in-memory snapshots of all persistent variables.  Capturing a snapshot
+ * copies the current value of every persistent variable, replacing any existing
+ * snapshot of the same name.  Restoring writes every captured value back in a
+ * single pass, through the corresponding record once records are bound, so
+ * each restored value is processed as if written to the record. */
+void capture_persistence_snapshot(const char *name);
+error__t restore_persistence_snapshot(const char *name);
+error__t delete_persistence_snapshot(const char *name);
+/* Prints the name and size of each snapshot. */
+void list_persistence_snapshots(void);
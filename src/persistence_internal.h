@@ -12,20 +12,40 @@ enum PERSISTENCE_TYPES {
 };
 
 
-/* Must be called before marking any variables as persistent. */
-void initialise_persistent_state(void);
+/* Must be called before marking any variables as persistent.  The table of
+ * persistent variables is sized for count variables, and this can be called
+ * again to reserve space for more. */
+void initialise_persistent_state(unsigned int count);
 
-/* Creates new persistent variable.  Note that type is *not* checked for
- * validity, *must* be a valid enum value! */
-void create_persistent_waveform(
+/* Handle to a single persistent variable. */
+struct persistent_variable;
+
+/* Creates new persistent variable and returns a handle for reading and writing
+ * it.  Note that type is *not* checked for validity, *must* be a valid enum
+ * value! */
+struct persistent_variable *create_persistent_waveform(
     const char *name, enum PERSISTENCE_TYPES type, unsigned int max_length);
 
 /* Updates variable from value stored on disk, returns false if no value
  * returned.  The function load_persistent_state() must be called first. */
-bool read_persistent_variable(const char *name, void *variable);
+bool read_persistent_variable(
+    struct persistent_variable *persistence, void *variable);
 bool read_persistent_waveform(
-    const char *name, void *variable, unsigned int *length);
+    struct persistent_variable *persistence,
+    void *variable, unsigned int *length);
 /* Writes value to persistent variable. */
-void write_persistent_variable(const char *name, const void *value);
+void write_persistent_variable(
+    struct persistent_variable *persistence, const void *value);
 void write_persistent_waveform(
-    const char *name, const void *value, unsigned int length);
+    struct persistent_variable *persistence,
+    const void *value, unsigned int length);
+
+/* Restoring a named snapshot writes each variable by calling this function with
+ * the variable, its name and the captured value, so that epics_device can write
+ * the value through the corresponding record.  Returns false if the value could
+ * not be written.  If no restore function is set each variable is written
+ * directly. */
+typedef bool persistence_restore_t(
+    struct persistent_variable *persistence, const char *name,
+    const void *value, unsigned int length);
+void set_persistence_restore(persistence_restore_t *restore);
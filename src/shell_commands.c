@@ -5,10 +5,12 @@
 #include <unistd.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
 #include <pthread.h>
 
 #include "error.h"
 #include "epics_device.h"
+#include "epics_extra.h"
 #include "persistence.h"
 
 #include <iocsh.h>
@@ -17,11 +19,38 @@
 
 static void call_initialise_epics_device(const iocshArgBuf *args)
 {
-    initialise_epics_device();
+    initialise_epics_device_capacity(
+        (unsigned int) MAX(args[0].ival, 0),
+        (unsigned int) MAX(args[1].ival, 0));
 }
 
 static const iocshFuncDef def_initialise_epics_device = {
-    "initialise_epics_device", 0, NULL
+    "initialise_epics_device", 2, (const iocshArg *[]) {
+        &(iocshArg) { "Records",        iocshArgInt },
+        &(iocshArg) { "Persistent",     iocshArgInt },
+    }
+};
+
+
+static void call_report_lazy_reads(const iocshArgBuf *args)
+{
+    report_lazy_reads(args[0].ival);
+}
+
+static const iocshFuncDef def_report_lazy_reads = {
+    "report_lazy_reads", 1, (const iocshArg *[]) {
+        &(iocshArg) { "Verbose",        iocshArgInt },
+    }
+};
+
+
+static void call_report_read_caches(const iocshArgBuf *args)
+{
+    report_read_caches();
+}
+
+static const iocshFuncDef def_report_read_caches = {
+    "report_read_caches", 0, NULL
 };
 
 
@@ -44,10 +73,247 @@ static const iocshFuncDef def_load_persistent_state = {
 };
 
 
+static void call_add_persistence_domain(const iocshArgBuf *args)
+{
+    const char *prefix = args[0].sval;
+    const char *file_name = args[1].sval;
+    int interval = args[2].ival;
+    error_report(
+        TEST_OK_(prefix, "Must specify a name prefix")  ?:
+        TEST_OK_(file_name, "Must specify a filename")  ?:
+        TEST_OK_(interval > 0, "Must specify a sensible interval")  ?:
+        add_persistence_domain(prefix, file_name, interval));
+}
+
+static const iocshFuncDef def_add_persistence_domain = {
+    "add_persistence_domain", 3, (const iocshArg *[]) {
+        &(iocshArg) { "Name prefix",    iocshArgString },
+        &(iocshArg) { "File name",      iocshArgString },
+        &(iocshArg) { "Save interval",  iocshArgInt },
+    }
+};
+
+
+static void call_set_persistence_format(const iocshArgBuf *args)
+{
+    const char *format = args[0].sval;
+    bool text = format  &&  strcmp(format, "text") == 0;
+    bool binary = format  &&  strcmp(format, "binary") == 0;
+
+    if (!error_report(TEST_OK_(text  ||  binary,
+            "Format must be text or binary")))
+        set_persistence_format(
+            binary ? PERSISTENCE_FORMAT_BINARY : PERSISTENCE_FORMAT_TEXT);
+}
+
+static const iocshFuncDef def_set_persistence_format = {
+    "set_persistence_format", 1, (const iocshArg *[]) {
+        &(iocshArg) { "text|binary",    iocshArgString },
+    }
+};
+
+
+static void call_set_persistence_journal(const iocshArgBuf *args)
+{
+    int compact_size = args[0].ival;
+    if (!error_report(TEST_OK_(compact_size >= 0,
+            "Must specify a sensible journal size")))
+        set_persistence_journal((size_t) compact_size);
+}
+
+static const iocshFuncDef def_set_persistence_journal = {
+    "set_persistence_journal", 1, (const iocshArg *[]) {
+        &(iocshArg) { "Compact size",   iocshArgInt },
+    }
+};
+
+
+static void call_set_persistence_durability(const iocshArgBuf *args)
+{
+    static const char *levels[] = { "none", "data", "full" };
+    const char *level = args[0].sval;
+    unsigned int ix = 0;
+    while (ix < ARRAY_SIZE(levels)  &&
+           !(level  &&  strcmp(level, levels[ix]) == 0))
+        ix += 1;
+
+    if (!error_report(TEST_OK_(ix < ARRAY_SIZE(levels),
+            "Durability must be none, data or full")))
+        set_persistence_durability((enum persistence_durability) ix);
+}
+
+static const iocshFuncDef def_set_persistence_durability = {
+    "set_persistence_durability", 1, (const iocshArg *[]) {
+        &(iocshArg) { "none|data|full", iocshArgString },
+    }
+};
+
+
+static void call_report_persistence_flush(const iocshArgBuf *args)
+{
+    report_persistence_flush();
+}
+
+static const iocshFuncDef def_report_persistence_flush = {
+    "report_persistence_flush", 0, NULL
+};
+
+
+static void call_report_persistence_stats(const iocshArgBuf *args)
+{
+    report_persistence_stats();
+}
+
+static const iocshFuncDef def_report_persistence_stats = {
+    "report_persistence_stats", 0, NULL
+};
+
+
+static void call_set_persistence_debounce(const iocshArgBuf *args)
+{
+    double debounce = args[0].dval;
+    if (!error_report(TEST_OK_(debounce >= 0,
+            "Must specify a sensible debounce interval")))
+        set_persistence_debounce(debounce);
+}
+
+static const iocshFuncDef def_set_persistence_debounce = {
+    "set_persistence_debounce", 1, (const iocshArg *[]) {
+        &(iocshArg) { "Debounce",       iocshArgDouble },
+    }
+};
+
+
+static void call_set_persistence_latency(const iocshArgBuf *args)
+{
+    const char *prefix = args[0].sval;
+    double max_latency = args[1].dval;
+    if (!error_report(
+            TEST_OK_(prefix, "Must specify a name prefix")  ?:
+            TEST_OK_(max_latency > 0, "Must specify a sensible latency")))
+        set_persistence_latency(prefix, max_latency);
+}
+
+static const iocshFuncDef def_set_persistence_latency = {
+    "set_persistence_latency", 2, (const iocshArg *[]) {
+        &(iocshArg) { "Name prefix",    iocshArgString },
+        &(iocshArg) { "Max latency",    iocshArgDouble },
+    }
+};
+
+
+static void call_capture_persistence_snapshot(const iocshArgBuf *args)
+{
+    const char *name = args[0].sval;
+    if (!error_report(TEST_OK_(name, "Must specify a snapshot name")))
+        capture_persistence_snapshot(name);
+}
+
+static const iocshFuncDef def_capture_persistence_snapshot = {
+    "capture_persistence_snapshot", 1, (const iocshArg *[]) {
+        &(iocshArg) { "Snapshot name",  iocshArgString },
+    }
+};
+
+
+static void call_restore_persistence_snapshot(const iocshArgBuf *args)
+{
+    const char *name = args[0].sval;
+    error_report(
+        TEST_OK_(name, "Must specify a snapshot name")  ?:
+        restore_persistence_snapshot(name));
+}
+
+static const iocshFuncDef def_restore_persistence_snapshot = {
+    "restore_persistence_snapshot", 1, (const iocshArg *[]) {
+        &(iocshArg) { "Snapshot name",  iocshArgString },
+    }
+};
+
+
+static void call_delete_persistence_snapshot(const iocshArgBuf *args)
+{
+    const char *name = args[0].sval;
+    error_report(
+        TEST_OK_(name, "Must specify a snapshot name")  ?:
+        delete_persistence_snapshot(name));
+}
+
+static const iocshFuncDef def_delete_persistence_snapshot = {
+    "delete_persistence_snapshot", 1, (const iocshArg *[]) {
+        &(iocshArg) { "Snapshot name",  iocshArgString },
+    }
+};
+
+
+static void call_list_persistence_snapshots(const iocshArgBuf *args)
+{
+    list_persistence_snapshots();
+}
+
+static const iocshFuncDef def_list_persistence_snapshots = {
+    "list_persistence_snapshots", 0, NULL
+};
+
+
+static void call_export_persistent_state(const iocshArgBuf *args)
+{
+    const char *file_name = args[0].sval;
+    error_report(
+        TEST_OK_(file_name, "Must specify a filename")  ?:
+        export_persistent_state(file_name));
+}
+
+static const iocshFuncDef def_export_persistent_state = {
+    "export_persistent_state", 1, (const iocshArg *[]) {
+        &(iocshArg) { "File name",      iocshArgString },
+    }
+};
+
+
+static void call_import_persistent_state(const iocshArgBuf *args)
+{
+    const char *file_name = args[0].sval;
+    error_report(
+        TEST_OK_(file_name, "Must specify a filename")  ?:
+        import_persistent_state(file_name, false));
+}
+
+static const iocshFuncDef def_import_persistent_state = {
+    "import_persistent_state", 1, (const iocshArg *[]) {
+        &(iocshArg) { "File name",      iocshArgString },
+    }
+};
+
+
 static void epicsShareAPI epics_device_registrar(void)
 {
     iocshRegister(&def_initialise_epics_device, &call_initialise_epics_device);
+    iocshRegister(&def_report_lazy_reads,       &call_report_lazy_reads);
+    iocshRegister(&def_report_read_caches,      &call_report_read_caches);
     iocshRegister(&def_load_persistent_state,   &call_load_persistent_state);
+    iocshRegister(&def_add_persistence_domain,  &call_add_persistence_domain);
+    iocshRegister(&def_set_persistence_format,  &call_set_persistence_format);
+    iocshRegister(&def_set_persistence_journal, &call_set_persistence_journal);
+    iocshRegister(&def_set_persistence_debounce,
+        &call_set_persistence_debounce);
+    iocshRegister(&def_set_persistence_latency, &call_set_persistence_latency);
+    iocshRegister(&def_set_persistence_durability,
+        &call_set_persistence_durability);
+    iocshRegister(&def_report_persistence_flush,
+        &call_report_persistence_flush);
+    iocshRegister(&def_report_persistence_stats,
+        &call_report_persistence_stats);
+    iocshRegister(&def_export_persistent_state, &call_export_persistent_state);
+    iocshRegister(&def_import_persistent_state, &call_import_persistent_state);
+    iocshRegister(&def_capture_persistence_snapshot,
+        &call_capture_persistence_snapshot);
+    iocshRegister(&def_restore_persistence_snapshot,
+        &call_restore_persistence_snapshot);
+    iocshRegister(&def_delete_persistence_snapshot,
+        &call_delete_persistence_snapshot);
+    iocshRegister(&def_list_persistence_snapshots,
+        &call_list_persistence_snapshots);
 }
 
 epicsExportRegistrar(epics_device_registrar);